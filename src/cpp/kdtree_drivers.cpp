@@ -1,178 +1,6974 @@
 #include <iostream>
 #include <vector>
+#include <array>
+#include <atomic>
 #include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <exception>
+#include <fstream>
 #include <cmath>
-#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <new>
+#include <numbers>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
+#include <utility>
+
+#include "thread_pool.h"
+
+// Process-wide, append-only table of driver names. Each distinct name is
+// copied once into a chunked character arena and handed out as a 32-bit id;
+// neither the characters nor the views ever move, so looking a name up is
+// two loads and a view stays valid for the life of the process.
+class NameTable {
+public:
+    static NameTable& global() {
+        static NameTable table;
+        return table;
+    }
+
+    NameTable(const NameTable&) = delete;
+    NameTable& operator=(const NameTable&) = delete;
+
+    uint32_t intern(std::string_view name) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            auto found = idByName.find(name);
+            if (found != idByName.end()) return found->second;
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        auto found = idByName.find(name);
+        if (found != idByName.end()) return found->second;
+
+        if (charChunks.empty() || name.size() > kCharChunk - charUsed) {
+            charChunks.push_back(std::make_unique<char[]>(std::max(kCharChunk, name.size())));
+            charUsed = 0;
+        }
+        char* stored = charChunks.back().get() + charUsed;
+        if (!name.empty()) std::memcpy(stored, name.data(), name.size());
+        charUsed += name.size();
+
+        uint32_t id = count;
+        size_t chunk = id >> kViewChunkBits;
+        std::string_view* views = viewChunks[chunk].load(std::memory_order_relaxed);
+        if (!views) {
+            views = new std::string_view[size_t{1} << kViewChunkBits];
+            viewChunks[chunk].store(views, std::memory_order_release);
+        }
+        views[id & kViewMask] = std::string_view(stored, name.size());
+        idByName.emplace(views[id & kViewMask], id);
+        ++count;
+        return id;
+    }
+
+    // `id` must have come from intern(); the Driver carrying it is what
+    // orders the lookup after the insertion
+    std::string_view view(uint32_t id) const {
+        return viewChunks[id >> kViewChunkBits].load(std::memory_order_acquire)[id & kViewMask];
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return count;
+    }
+
+private:
+    static constexpr size_t kCharChunk = 64 * 1024;
+    static constexpr unsigned kViewChunkBits = 16;
+    static constexpr uint32_t kViewMask = (1u << kViewChunkBits) - 1;
+    static constexpr size_t kViewChunks = size_t{1} << (32 - kViewChunkBits);
+
+    mutable std::shared_mutex mutex;
+    std::vector<std::unique_ptr<char[]>> charChunks;
+    size_t charUsed = 0;
+    std::unordered_map<std::string_view, uint32_t> idByName;
+    // Fixed directory, so readers never race with it growing
+    std::unique_ptr<std::atomic<std::string_view*>[]> viewChunks;
+    uint32_t count = 0;
+
+    NameTable() : viewChunks(new std::atomic<std::string_view*>[kViewChunks]) {
+        for (size_t i = 0; i < kViewChunks; ++i) viewChunks[i].store(nullptr, std::memory_order_relaxed);
+        // Id 0 is the empty name, which default-constructed drivers carry
+        intern(std::string_view());
+    }
+
+    ~NameTable() {
+        for (size_t i = 0; i < kViewChunks; ++i) delete[] viewChunks[i].load(std::memory_order_relaxed);
+    }
+};
+
+// Trivially copyable: the name is interned on construction and only its id
+// travels with the driver.
+// Fleets one index can tell apart: one bit each in a FleetMask. 32 keeps
+// KDNode to one cache line; a deployment with more brands needs a wider mask.
+constexpr size_t kMaxFleets = 32;
+using FleetMask = uint32_t;
+
+// The fleet itself, or std::invalid_argument if no FleetMask bit can hold
+// it; wrapping it instead would let one fleet's riders see another's drivers
+inline uint8_t checkedFleet(uint8_t fleet) {
+    if (fleet >= kMaxFleets) throw std::invalid_argument("fleet id must be below kMaxFleets");
+    return fleet;
+}
+
+constexpr FleetMask fleetBit(uint8_t fleet) {
+    return FleetMask{1} << fleet;
+}
 
 struct Driver {
-    int id;
-    double lat;
-    double lng;
-    std::string name;
-    bool available;
+    int id = 0;
+    uint32_t nameId = 0;
+    double lat = 0.0;
+    double lng = 0.0;
+    bool available = false;
+    // Brand or fleet the driver works for. Must be below kMaxFleets (32):
+    // the constructor and every index write path reject anything higher.
+    uint8_t fleet = 0;
+
+    Driver() = default;
+    Driver(int driverId, double latitude, double longitude, std::string_view driverName, bool isAvailable,
+           uint8_t driverFleet = 0)
+        : id(driverId), nameId(NameTable::global().intern(driverName)),
+          lat(latitude), lng(longitude), available(isAvailable), fleet(checkedFleet(driverFleet)) {}
+
+    std::string_view name() const {
+        return NameTable::global().view(nameId);
+    }
 };
 
-struct KDNode {
+// Nodes live in a pool owned by the tree and refer to their children by index,
+// so traversals never touch a reference count and tearing down a degenerate
+// tree cannot blow the stack. Each node also knows its parent, how many
+// nodes sit in its subtree and how many of those are tombstones. A deleted
+// driver stays in place as a tombstone, still routing searches, until
+// compaction rebuilds the subtree around it. `fleets` covers every fleet
+// with a live driver below; deletes leave it a superset until the subtree is
+// next rebuilt. A node fills exactly one cache line.
+struct alignas(64) KDNode {
     Driver driver;
-    std::shared_ptr<KDNode> left;
-    std::shared_ptr<KDNode> right;
+    int32_t left;
+    int32_t right;
+    int32_t parent;
+    int32_t count;
+    int32_t dead;
     int depth;
+    bool deleted;
+    FleetMask fleets;
 
-    KDNode(const Driver& d, int dpt) : driver(d), left(nullptr), right(nullptr), depth(dpt) {}
+    KDNode(const Driver& d, int dpt)
+        : driver(d), left(-1), right(-1), parent(-1), count(1), dead(0), depth(dpt), deleted(false),
+          fleets(fleetBit(d.fleet)) {}
 };
 
-// KD-tree class
-class KDTree {
+static_assert(sizeof(KDNode) == 64, "KDNode is meant to fill a single cache line");
+
+// A change to one driver, as applied by KDTree::applyBatch
+enum class UpdateKind {
+    Upsert,
+    Remove
+};
+
+struct Update {
+    Driver driver;
+    UpdateKind kind = UpdateKind::Upsert;
+};
+
+// Stack with a fixed inline buffer; only traversals deeper than N spill to the heap.
+template <typename T, size_t N>
+class InlineStack {
 private:
-    std::shared_ptr<KDNode> root;
+    std::array<T, N> items;
+    std::vector<T> overflow;
+    size_t count = 0;
 
-    // Calculate squared distance between two points
-    double squaredDistance(double lat1, double lng1, double lat2, double lng2) {
-        double dlat = lat2 - lat1;
-        double dlng = lng2 - lng1;
-        return dlat * dlat + dlng * dlng;
-    }
+public:
+    bool empty() const { return count == 0; }
 
+    void push(const T& value) {
+        if (count < N) {
+            items[count] = value;
+        } else {
+            overflow.push_back(value);
+        }
+        ++count;
+    }
 
-    std::shared_ptr<KDNode> insertRecursive(std::shared_ptr<KDNode> node, const Driver& driver, int depth) {
-        if (!node) {
-            return std::make_shared<KDNode>(driver, depth);
+    T pop() {
+        --count;
+        if (count < N) {
+            return items[count];
         }
+        T value = overflow.back();
+        overflow.pop_back();
+        return value;
+    }
+};
 
-        bool useLat = (depth % 2 == 0);
-        double currentValue = useLat ? node->driver.lat : node->driver.lng;
-        double newValue = useLat ? driver.lat : driver.lng;
+// A rider location for batched lookups
+struct Query {
+    double lat;
+    double lng;
+};
 
-        if (newValue < currentValue) {
-            node->left = insertRecursive(node->left, driver, depth + 1);
-        } else {
-            node->right = insertRecursive(node->right, driver, depth + 1);
+// One hit written into a caller-supplied result buffer
+struct Neighbor {
+    int id;
+    // Same units as the index's own distance: squared degrees for KDTree,
+    // squared metres for ProjectedShard
+    double distanceSq;
+};
+
+// Keep out[0, filled) sorted by distance, never growing past out.size()
+inline void offerNeighbor(std::span<Neighbor> out, size_t& filled, double dist, int id) {
+    if (filled == out.size()) {
+        if (dist >= out[filled - 1].distanceSq) return;
+        --filled;
+    }
+    size_t pos = filled++;
+    for (; pos > 0 && out[pos - 1].distanceSq > dist; --pos) {
+        out[pos] = out[pos - 1];
+    }
+    out[pos] = {id, dist};
+}
+
+// Scratch memory for queries: a chain of blocks handed out by bumping an
+// offset. Nothing is freed individually; reset() rewinds to the first block
+// in O(1) and keeps every block, so once a thread's context has grown to its
+// working size, queries through it stop touching malloc. Results returned
+// through a context live until its next reset().
+class QueryContext {
+public:
+    explicit QueryContext(size_t firstBlockBytes = 64 * 1024) : nextBlockBytes(firstBlockBytes) {}
+
+    QueryContext(const QueryContext&) = delete;
+    QueryContext& operator=(const QueryContext&) = delete;
+
+    // One context per thread, for callers that do not keep their own
+    static QueryContext& local() {
+        thread_local QueryContext context;
+        return context;
+    }
+
+    // Room for `count` default-initialised Ts. No destructor will ever run.
+    template <typename T>
+    std::span<T> allocate(size_t count) {
+        static_assert(std::is_trivially_destructible_v<T>, "QueryContext never runs destructors");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "blocks are only max_align_t aligned");
+        if (count == 0) return {};
+        size_t bytes = count * sizeof(T);
+        while (true) {
+            if (current < blocks.size()) {
+                Block& block = blocks[current];
+                size_t start = (offset + alignof(T) - 1) & ~(alignof(T) - 1);
+                if (start + bytes <= block.size) {
+                    offset = start + bytes;
+                    T* items = reinterpret_cast<T*>(block.data.get() + start);
+                    std::uninitialized_default_construct_n(items, count);
+                    return {items, count};
+                }
+                if (current + 1 < blocks.size()) {
+                    ++current;
+                    offset = 0;
+                    continue;
+                }
+            }
+            size_t size = std::max(nextBlockBytes, bytes);
+            blocks.push_back({std::make_unique<std::byte[]>(size), size});
+            nextBlockBytes = size * 2;
+            current = blocks.size() - 1;
+            offset = 0;
         }
+    }
 
-        return node;
+    void reset() {
+        current = 0;
+        offset = 0;
     }
 
+    size_t reservedBytes() const {
+        size_t total = 0;
+        for (const Block& block : blocks) total += block.size;
+        return total;
+    }
 
-    void findNearestNeighborsRecursive(
-        std::shared_ptr<KDNode> node,
-        double targetLat,
-        double targetLng,
-        int k,
-        std::vector<std::pair<double, Driver>>& nearest,
-        int depth
-    ) {
-        if (!node) return;
+private:
+    struct Block {
+        std::unique_ptr<std::byte[]> data;
+        size_t size;
+    };
 
+    std::vector<Block> blocks;
+    size_t current = 0;
+    size_t offset = 0;
+    size_t nextBlockBytes;
+};
 
-        double dist = squaredDistance(targetLat, targetLng, node->driver.lat, node->driver.lng);
+// Which side of a geofence a search keeps
+enum class FenceMode {
+    Inside,
+    Outside
+};
 
+// How a rectangle of the plane lies against a geofence
+enum class FenceCover {
+    Inside,
+    Outside,
+    Straddling
+};
 
-        if (node->driver.available) {
-            if (nearest.size() < k) {
-                nearest.push_back({dist, node->driver});
-                std::sort(nearest.begin(), nearest.end());
-            } else if (dist < nearest.back().first) {
-                nearest.back() = {dist, node->driver};
-                std::sort(nearest.begin(), nearest.end());
+// A simple polygon in lat/lng, e.g. an airport lot or a restricted zone.
+// Longitudes along the ring are unwrapped from the first vertex, so a fence
+// drawn across the antimeridian stays one piece; points and rectangles are
+// shifted into the fence's 360-degree window before testing. Edges are kept
+// as parallel arrays so the crossing-number test is a branch-free loop the
+// compiler vectorises.
+class Geofence {
+public:
+    // `ring` holds (lat, lng) vertices in order; closing it is implied
+    explicit Geofence(const std::vector<std::pair<double, double>>& ring) {
+        size_t count = ring.size();
+        std::vector<double> lngs(count);
+        for (size_t i = 0; i < count; ++i) {
+            double lng = ring[i].second;
+            if (i == 0) {
+                lngs[i] = std::remainder(lng, 360.0);
+            } else {
+                lngs[i] = lngs[i - 1] + std::remainder(lng - lngs[i - 1], 360.0);
             }
         }
+        for (size_t i = 0; i < count; ++i) {
+            size_t next = (i + 1) % count;
+            double lat0 = ring[i].first;
+            double lat1 = ring[next].first;
+            lat0s.push_back(lat0);
+            lat1s.push_back(lat1);
+            lng0s.push_back(lngs[i]);
+            lng1s.push_back(lngs[next]);
+            slopes.push_back(lat1 != lat0 ? (lngs[next] - lngs[i]) / (lat1 - lat0) : 0.0);
+            south = std::min(south, lat0);
+            north = std::max(north, lat0);
+            west = std::min(west, lngs[i]);
+            east = std::max(east, lngs[i]);
+        }
+    }
 
-        // Determine which branch to explore first
-        bool useLat = (depth % 2 == 0);
-        double currentValue = useLat ? node->driver.lat : node->driver.lng;
-        double targetValue = useLat ? targetLat : targetLng;
+    size_t vertices() const { return lat0s.size(); }
 
-        std::shared_ptr<KDNode> first = (targetValue < currentValue) ? node->left : node->right;
-        std::shared_ptr<KDNode> second = (targetValue < currentValue) ? node->right : node->left;
+    bool contains(double lat, double lng) const {
+        lng = intoWindow(lng);
+        if (lat < south || lat > north || lng > east) return false;
+        const double* lat0 = lat0s.data();
+        const double* lat1 = lat1s.data();
+        const double* lng0 = lng0s.data();
+        const double* slope = slopes.data();
+        int crossings = 0;
+        for (size_t i = 0, n = lat0s.size(); i < n; ++i) {
+            bool spans = (lat0[i] > lat) != (lat1[i] > lat);
+            double crossLng = lng0[i] + (lat - lat0[i]) * slope[i];
+            crossings += spans & (lng < crossLng);
+        }
+        return crossings & 1;
+    }
 
-        // Explore first branch
-        if (first) {
-            findNearestNeighborsRecursive(first, targetLat, targetLng, k, nearest, depth + 1);
+    // Classify the closed rectangle; a rectangle no edge passes through is
+    // wholly on one side, settled by testing its centre
+    FenceCover cover(double latLo, double latHi, double lngLo, double lngHi) const {
+        bool anyInside = false;
+        bool anyOutside = false;
+        // The rectangle may fall partly on each side of the window's seam
+        for (double shift : {-360.0, 0.0, 360.0}) {
+            double lo = std::max(lngLo + shift, west);
+            double hi = std::min(lngHi + shift, west + 360.0);
+            if (lo > hi) continue;
+            FenceCover piece = coverWindowed(latLo, latHi, lo, hi);
+            if (piece == FenceCover::Straddling) return piece;
+            (piece == FenceCover::Inside ? anyInside : anyOutside) = true;
         }
+        if (anyInside && anyOutside) return FenceCover::Straddling;
+        return anyInside ? FenceCover::Inside : FenceCover::Outside;
+    }
+
+private:
+    std::vector<double> lat0s;
+    std::vector<double> lat1s;
+    std::vector<double> lng0s;
+    std::vector<double> lng1s;
+    // Change in lng per degree of lat along each edge
+    std::vector<double> slopes;
+    double south = std::numeric_limits<double>::infinity();
+    double north = -std::numeric_limits<double>::infinity();
+    double west = std::numeric_limits<double>::infinity();
+    double east = -std::numeric_limits<double>::infinity();
+
+    double intoWindow(double lng) const {
+        return lng - 360.0 * std::floor((lng - west) / 360.0);
+    }
+
+    // Liang-Barsky clip of one edge against the rectangle
+    static bool edgeTouches(double lat0, double lng0, double lat1, double lng1,
+                            double latLo, double latHi, double lngLo, double lngHi) {
+        double enter = 0.0;
+        double leave = 1.0;
+        auto clip = [&](double p, double q) {
+            if (p == 0.0) return q >= 0.0;
+            double t = q / p;
+            if (p < 0.0) {
+                if (t > leave) return false;
+                enter = std::max(enter, t);
+            } else {
+                if (t < enter) return false;
+                leave = std::min(leave, t);
+            }
+            return true;
+        };
+        double dLat = lat1 - lat0;
+        double dLng = lng1 - lng0;
+        return clip(-dLat, lat0 - latLo) && clip(dLat, latHi - lat0) &&
+               clip(-dLng, lng0 - lngLo) && clip(dLng, lngHi - lng0);
+    }
 
-        // Check if we need to explore second branch
-        if (second && nearest.size() < k) {
-            double axisDist = (targetValue - currentValue) * (targetValue - currentValue);
-            if (axisDist < nearest.back().first) {
-                findNearestNeighborsRecursive(second, targetLat, targetLng, k, nearest, depth + 1);
+    FenceCover coverWindowed(double latLo, double latHi, double lngLo, double lngHi) const {
+        if (latHi < south || latLo > north || lngHi < west || lngLo > east) return FenceCover::Outside;
+        for (size_t i = 0; i < lat0s.size(); ++i) {
+            if (edgeTouches(lat0s[i], lng0s[i], lat1s[i], lng1s[i], latLo, latHi, lngLo, lngHi)) {
+                return FenceCover::Straddling;
             }
         }
+        return contains((latLo + latHi) / 2, (lngLo + lngHi) / 2) ? FenceCover::Inside : FenceCover::Outside;
     }
+};
 
-    // Delete a driver from the KD-tree
-    std::shared_ptr<KDNode> deleteRecursive(std::shared_ptr<KDNode> node, const Driver& driver, int depth) {
-        if (!node) return nullptr;
+// How a batch of lookups hides memory latency: explicit per-node stepping of
+// a fixed group, or one coroutine per query suspended on every prefetch.
+enum class BatchStrategy {
+    Stepped,
+    Coroutine
+};
 
-        bool useLat = (depth % 2 == 0);
-        double currentValue = useLat ? node->driver.lat : node->driver.lng;
-        double targetValue = useLat ? driver.lat : driver.lng;
+// Awaiting a prefetch starts the load and hands control back to the scheduler,
+// which resumes another query while the line is in flight.
+struct PrefetchAwaiter {
+    const void* address;
 
-        if (node->driver.id == driver.id) {
-            // Node to delete found
-            if (!node->right) {
-                return node->left;
-            }
-            if (!node->left) {
-                return node->right;
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<>) const noexcept { __builtin_prefetch(address); }
+    void await_resume() const noexcept {}
+};
+
+// Lazily started coroutine that the batch scheduler resumes round-robin
+class SearchTask {
+public:
+    struct promise_type {
+        SearchTask get_return_object() {
+            return SearchTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+
+        // Frames are all the same size, so recycle them through a per-thread
+        // free list instead of going back to malloc for every query.
+        static void* operator new(size_t size) {
+            FramePool& pool = framePool();
+            if (size == pool.frameSize && !pool.free.empty()) {
+                void* frame = pool.free.back();
+                pool.free.pop_back();
+                return frame;
             }
+            return ::operator new(size);
+        }
 
-            // Find minimum in right subtree
-            std::shared_ptr<KDNode> minNode = node->right;
-            while (minNode->left) {
-                minNode = minNode->left;
+        static void operator delete(void* frame, size_t size) {
+            FramePool& pool = framePool();
+            if (pool.frameSize == 0) pool.frameSize = size;
+            if (size == pool.frameSize && pool.free.size() < kMaxPooledFrames) {
+                pool.free.push_back(frame);
+                return;
             }
+            ::operator delete(frame);
+        }
+    };
 
-            // Copy minimum node's data
-            node->driver = minNode->driver;
+    SearchTask() = default;
+    explicit SearchTask(std::coroutine_handle<promise_type> h) : handle(h) {}
+    SearchTask(SearchTask&& other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    SearchTask& operator=(SearchTask&& other) noexcept {
+        if (this != &other) {
+            if (handle) handle.destroy();
+            handle = std::exchange(other.handle, nullptr);
+        }
+        return *this;
+    }
+    SearchTask(const SearchTask&) = delete;
+    SearchTask& operator=(const SearchTask&) = delete;
+    ~SearchTask() {
+        if (handle) handle.destroy();
+    }
 
-            // Delete minimum node
-            node->right = deleteRecursive(node->right, minNode->driver, depth + 1);
-        } else if (targetValue < currentValue) {
-            node->left = deleteRecursive(node->left, driver, depth + 1);
-        } else {
-            node->right = deleteRecursive(node->right, driver, depth + 1);
+    explicit operator bool() const { return static_cast<bool>(handle); }
+
+    // Run until the next suspension point; returns false once the search is done
+    bool resume() {
+        handle.resume();
+        return !handle.done();
+    }
+
+private:
+    static constexpr size_t kMaxPooledFrames = 64;
+
+    struct FramePool {
+        size_t frameSize = 0;
+        std::vector<void*> free;
+
+        ~FramePool() {
+            for (void* frame : free) ::operator delete(frame);
         }
+    };
 
-        return node;
+    static FramePool& framePool() {
+        thread_local FramePool pool;
+        return pool;
     }
 
-public:
-    KDTree() : root(nullptr) {}
+    std::coroutine_handle<promise_type> handle;
+};
 
-    // Insert a driver
-    void insert(const Driver& driver) {
-        root = insertRecursive(root, driver, 0);
+// Physical order of nodes produced by a bulk build. Depth-first keeps each
+// near-side descent sequential, breadth-first packs the top levels together,
+// and van Emde Boas recursively groups subtrees so a root-to-leaf walk touches
+// O(log_B n) cache lines whatever the line size.
+enum class NodeLayout {
+    DepthFirst,
+    BreadthFirst,
+    VanEmdeBoas
+};
+
+// KD-tree class
+class KDTree {
+private:
+    // Reuses the median-split build helpers below
+    friend class PersistentKDTree;
+    friend class ProjectedShard;
+    friend class ScoredShard;
+
+    static constexpr int32_t kNull = -1;
+    static constexpr size_t kInlineStackDepth = 64;
+    static constexpr size_t kBatchInterleave = 8;
+    static constexpr size_t kCoroutinesInFlight = 16;
+    static constexpr int kResidentLevels = 12;
+    static constexpr size_t kParallelBuildMinimum = 1 << 16;
+    static constexpr size_t kQueriesPerTask = 256;
+    static constexpr size_t kRadiusGuess = 256;
+    // A batch rebuilds a subtree of at least kMinRebuildSize drivers once it
+    // carries kRebuildPercent events per hundred drivers there; a moved driver
+    // is two events. Below that, erase/insert per driver is cheaper.
+    static constexpr int32_t kMinRebuildSize = 16;
+    static constexpr size_t kRebuildPercent = 80;
+    // A subtree of at least kMinRebuildSize nodes is due for compaction once
+    // kCompactPercent of them are tombstones; at kCollapsePercent across the
+    // whole tree the mutating call compacts inline rather than wait.
+    static constexpr size_t kCompactPercent = 25;
+    static constexpr size_t kCollapsePercent = 50;
+
+    std::vector<KDNode> nodes;
+    std::vector<int32_t> freeSlots;
+    int32_t root;
+    std::unordered_map<int, int32_t> nodeById;
+    ThreadPool* pool = nullptr;
+    bool compactionDue = false;
+
+    // Split coordinate for an axis; written as a select so it compiles to a cmov
+    static double axisValue(const Driver& driver, int axis) {
+        return axis ? driver.lng : driver.lat;
     }
 
-    // Find k nearest neighbors
-    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) {
+    // Squared distance from the target to the far side of a splitting plane
+    // `diff` away, a lower bound for everything there. Longitudes wrap, so
+    // across an lng plane the far side can also be reached round the
+    // antimeridian, which is never further than 180 - |lng|.
+    static double farSideBound(const double target[2], int axis, double diff) {
+        double wrapped = 180.0 - std::abs(target[1]);
+        double gap = axis ? std::min(std::abs(diff), wrapped) : diff;
+        return gap * gap;
+    }
+
+    int32_t allocateNode(const Driver& driver, int depth) {
+        if (!freeSlots.empty()) {
+            int32_t index = freeSlots.back();
+            freeSlots.pop_back();
+            nodes[index] = KDNode(driver, depth);
+            return index;
+        }
+        nodes.emplace_back(driver, depth);
+        return static_cast<int32_t>(nodes.size() - 1);
+    }
+
+    void releaseNode(int32_t index) {
+        freeSlots.push_back(index);
+    }
+
+    // Keep `nearest` sorted by distance and capped at k entries
+    static void offerCandidate(std::vector<std::pair<double, Driver>>& nearest, size_t k,
+                               double dist, const Driver& driver) {
+        if (nearest.size() == k) {
+            if (dist >= nearest.back().first) return;
+            nearest.pop_back();
+        }
+        auto pos = std::upper_bound(nearest.begin(), nearest.end(), dist,
+            [](double d, const std::pair<double, Driver>& entry) { return d < entry.first; });
+        nearest.insert(pos, {dist, driver});
+    }
+
+    // Pull a node's cache line towards L1 ahead of its visit
+    void prefetchNode(int32_t index) const {
+        if (index == kNull) return;
+        __builtin_prefetch(&nodes[index]);
+    }
+
+    // Each deferred subtree carries the squared distance to its splitting
+    // plane, which is a lower bound on anything inside it.
+    struct SearchFrame {
+        int32_t node;
+        double bound;
+    };
+
+    // One kNN search advanced a node at a time, so a batch can interleave
+    // several of them and overlap one query's cache misses with another's work.
+    struct NearestSearch {
+        double target[2];
+        size_t k;
+        int32_t current;
+        InlineStack<SearchFrame, kInlineStackDepth> pending;
         std::vector<std::pair<double, Driver>> nearest;
-        findNearestNeighborsRecursive(root, targetLat, targetLng, k, nearest, 0);
-        
+    };
+
+    void beginSearch(NearestSearch& search, double targetLat, double targetLng, size_t k) const {
+        search.target[0] = targetLat;
+        search.target[1] = targetLng;
+        search.k = k;
+        search.current = kNull;
+        search.nearest.clear();
+        if (root != kNull && k > 0) {
+            search.pending.push({root, 0.0});
+            prefetchNode(root);
+        }
+    }
+
+    // Visit one node, prefetching whatever comes next. Resuming a deferred
+    // subtree only issues its prefetch and yields. Returns false once done.
+    bool stepSearch(NearestSearch& search) const {
+        if (search.current == kNull) {
+            while (true) {
+                if (search.pending.empty()) return false;
+                SearchFrame frame = search.pending.pop();
+                if (search.nearest.size() < search.k || frame.bound < search.nearest.back().first) {
+                    search.current = frame.node;
+                    prefetchNode(frame.node);
+                    return true;
+                }
+            }
+        }
+
+        // Walk down the near side, deferring each far side
+        const KDNode& node = nodes[search.current];
+        if (node.dead == node.count) {
+            // Nothing but tombstones below here
+            search.current = kNull;
+            return true;
+        }
+        prefetchNode(node.left);
+        prefetchNode(node.right);
+
+        if (node.driver.available && !node.deleted) {
+            double dist = squaredDistance(search.target[0], search.target[1], node.driver.lat, node.driver.lng);
+            offerCandidate(search.nearest, search.k, dist, node.driver);
+        }
+
+        int axis = node.depth & 1;
+        double diff = search.target[axis] - axisValue(node.driver, axis);
+        bool goLeft = diff < 0;
+        int32_t nearChild = goLeft ? node.left : node.right;
+        int32_t farChild = goLeft ? node.right : node.left;
+
+        if (farChild != kNull) {
+            search.pending.push({farChild, farSideBound(search.target, axis, diff)});
+        }
+        search.current = nearChild;
+        return true;
+    }
+
+    static std::vector<Driver> collectResult(const NearestSearch& search) {
         std::vector<Driver> result;
-        for (const auto& pair : nearest) {
+        result.reserve(search.nearest.size());
+        for (const auto& pair : search.nearest) {
             result.push_back(pair.second);
         }
         return result;
     }
 
-    // Delete a driver
-    void remove(const Driver& driver) {
-        root = deleteRecursive(root, driver, 0);
+    void batchStepped(const Query* queries, size_t count, size_t limit, std::vector<Driver>* results) const {
+        std::vector<NearestSearch> slots(std::min(kBatchInterleave, count));
+        std::vector<size_t> owner(slots.size());
+        size_t next = 0;
+        size_t active = 0;
+        for (; active < slots.size(); ++active, ++next) {
+            beginSearch(slots[active], queries[next].lat, queries[next].lng, limit);
+            owner[active] = next;
+        }
+
+        while (active > 0) {
+            for (size_t slot = 0; slot < active;) {
+                if (stepSearch(slots[slot])) {
+                    ++slot;
+                    continue;
+                }
+                results[owner[slot]] = collectResult(slots[slot]);
+                if (next < count) {
+                    beginSearch(slots[slot], queries[next].lat, queries[next].lng, limit);
+                    owner[slot] = next++;
+                    ++slot;
+                } else {
+                    // Retire the slot by swapping the last active search into it
+                    --active;
+                    std::swap(slots[slot], slots[active]);
+                    std::swap(owner[slot], owner[active]);
+                }
+            }
+        }
     }
 
-    // Update a driver's position
-    void update(const Driver& driver) {
-        remove(driver);
-        insert(driver);
+    // kNN search as a coroutine that suspends on a prefetch before touching
+    // each node, so the scheduler can run other queries while it misses.
+    SearchTask searchCoroutine(double targetLat, double targetLng, size_t k,
+                               std::vector<std::pair<double, Driver>>& nearest) const {
+        if (root == kNull || k == 0) co_return;
+
+        const double target[2] = {targetLat, targetLng};
+        InlineStack<SearchFrame, kInlineStackDepth> pending;
+        pending.push({root, 0.0});
+
+        while (!pending.empty()) {
+            SearchFrame frame = pending.pop();
+            if (nearest.size() == k && frame.bound >= nearest.back().first) continue;
+
+            co_await PrefetchAwaiter{&nodes[frame.node]};
+            for (int32_t index = frame.node; index != kNull;) {
+                const KDNode& node = nodes[index];
+                if (node.dead == node.count) break;
+
+                if (node.driver.available && !node.deleted) {
+                    double dist = squaredDistance(targetLat, targetLng, node.driver.lat, node.driver.lng);
+                    offerCandidate(nearest, k, dist, node.driver);
+                }
+
+                int axis = node.depth & 1;
+                double diff = target[axis] - axisValue(node.driver, axis);
+                bool goLeft = diff < 0;
+                int32_t nearChild = goLeft ? node.left : node.right;
+                int32_t farChild = goLeft ? node.right : node.left;
+
+                if (farChild != kNull) {
+                    pending.push({farChild, farSideBound(target, axis, diff)});
+                }
+                // The top of the tree stays cache resident; suspending there costs more than it hides
+                if (nearChild != kNull && node.depth >= kResidentLevels) {
+                    co_await PrefetchAwaiter{&nodes[nearChild]};
+                }
+                index = nearChild;
+            }
+        }
     }
-};
 
-// Main function for testing
-int main() {
-    KDTree tree;
-    
+    void batchCoroutines(const Query* queries, size_t count, size_t limit, std::vector<Driver>* results) const {
+        // Slots keep their result buffer across queries so its capacity is reused
+        size_t width = std::min(kCoroutinesInFlight, count);
+        std::vector<SearchTask> tasks(width);
+        std::vector<std::vector<std::pair<double, Driver>>> nearest(width);
+        std::vector<size_t> owner(width);
+        size_t next = 0;
+        size_t active = 0;
+        for (; active < width; ++active, ++next) {
+            tasks[active] = searchCoroutine(queries[next].lat, queries[next].lng, limit, nearest[active]);
+            owner[active] = next;
+        }
+
+        while (active > 0) {
+            for (size_t slot = 0; slot < width; ++slot) {
+                if (!tasks[slot] || tasks[slot].resume()) continue;
+
+                std::vector<Driver>& result = results[owner[slot]];
+                result.reserve(nearest[slot].size());
+                for (const auto& pair : nearest[slot]) {
+                    result.push_back(pair.second);
+                }
+                nearest[slot].clear();
+
+                if (next < count) {
+                    tasks[slot] = searchCoroutine(queries[next].lat, queries[next].lng, limit, nearest[slot]);
+                    owner[slot] = next++;
+                } else {
+                    tasks[slot] = SearchTask();
+                    --active;
+                }
+            }
+        }
+    }
+
+    // Shape of a bulk-built tree before it is laid out; `item` indexes the input
+    struct BuildNode {
+        size_t item;
+        int32_t left;
+        int32_t right;
+        int depth;
+    };
+
+    // Builds shuffle these small trivially copyable keys rather than whole
+    // drivers; `item` indexes the driver list being built from.
+    struct BuildPoint {
+        double coord[2];
+        size_t item;
+    };
+
+    static std::vector<BuildPoint> buildPoints(const std::vector<Driver>& drivers) {
+        std::vector<BuildPoint> points(drivers.size());
+        for (size_t i = 0; i < drivers.size(); ++i) {
+            points[i] = {{drivers[i].lat, drivers[i].lng}, i};
+        }
+        return points;
+    }
+
+    // Partition [lo, hi) around its median on `axis` so everything left of the
+    // returned position is strictly smaller, matching where insert sends ties.
+    template <typename Point>
+    static size_t splitAtMedian(std::vector<Point>& points, size_t lo, size_t hi, int axis) {
+        auto less = [axis](const Point& a, const Point& b) {
+            return a.coord[axis] < b.coord[axis];
+        };
+        size_t mid = lo + (hi - lo) / 2;
+        std::nth_element(points.begin() + lo, points.begin() + mid, points.begin() + hi, less);
+        double split = points[mid].coord[axis];
+        auto firstTie = std::partition(points.begin() + lo, points.begin() + mid,
+            [axis, split](const Point& p) { return p.coord[axis] < split; });
+        size_t tie = static_cast<size_t>(firstTie - points.begin());
+        std::swap(points[tie], points[mid]);
+        return tie;
+    }
+
+    struct BuildRange {
+        size_t lo;
+        size_t hi;
+        int depth;
+        int32_t parent;
+        bool asLeft;
+    };
+
+    // Split every range in `work` down to single nodes, appending them to
+    // `shape` in preorder, cycling through the first `dims` coordinates.
+    // Ranges no larger than `deferBelow` are handed back through `deferred`
+    // instead so they can be built elsewhere.
+    template <typename Point>
+    static void splitRanges(std::vector<Point>& points, std::vector<BuildRange>& work,
+                            std::vector<BuildNode>& shape, size_t deferBelow,
+                            std::vector<BuildRange>* deferred, int dims = 2) {
+        // Left ranges are pushed last so they are split first
+        while (!work.empty()) {
+            BuildRange range = work.back();
+            work.pop_back();
+            if (deferred && range.hi - range.lo <= deferBelow) {
+                deferred->push_back(range);
+                continue;
+            }
+            size_t mid = splitAtMedian(points, range.lo, range.hi, range.depth % dims);
+            int32_t self = static_cast<int32_t>(shape.size());
+            shape.push_back({points[mid].item, kNull, kNull, range.depth});
+            if (range.parent != kNull) {
+                (range.asLeft ? shape[range.parent].left : shape[range.parent].right) = self;
+            }
+            if (mid + 1 < range.hi) work.push_back({mid + 1, range.hi, range.depth + 1, self, false});
+            if (range.lo < mid) work.push_back({range.lo, mid, range.depth + 1, self, true});
+        }
+    }
+
+    // The shape always has its root at index 0. With a pool, the top of the
+    // tree is split serially until there are a few ranges per worker, which
+    // are then split in parallel and stitched back in.
+    std::vector<BuildNode> buildShape(const std::vector<Driver>& drivers) const {
+        std::vector<BuildNode> shape;
+        shape.reserve(drivers.size());
+        if (drivers.empty()) return shape;
+
+        std::vector<BuildPoint> points = buildPoints(drivers);
+        std::vector<BuildRange> work{{0, drivers.size(), 0, kNull, false}};
+        if (!pool || drivers.size() < kParallelBuildMinimum) {
+            splitRanges(points, work, shape, 0, nullptr);
+            return shape;
+        }
+
+        std::vector<BuildRange> deferred;
+        size_t deferBelow = std::max(kParallelBuildMinimum / 4, drivers.size() / (pool->size() * 4));
+        splitRanges(points, work, shape, deferBelow, &deferred);
+
+        std::vector<std::vector<BuildNode>> parts(deferred.size());
+        pool->parallelFor(deferred.size(), 1, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                std::vector<BuildRange> local{deferred[i]};
+                local.back().parent = kNull;
+                splitRanges(points, local, parts[i], 0, nullptr);
+            }
+        });
+
+        for (size_t i = 0; i < deferred.size(); ++i) {
+            int32_t offset = static_cast<int32_t>(shape.size());
+            for (BuildNode node : parts[i]) {
+                if (node.left != kNull) node.left += offset;
+                if (node.right != kNull) node.right += offset;
+                shape.push_back(node);
+            }
+            const BuildRange& range = deferred[i];
+            (range.asLeft ? shape[range.parent].left : shape[range.parent].right) = offset;
+        }
+        return shape;
+    }
+
+    // Drivers under each shape node; children always sit after their parent
+    static std::vector<int32_t> subtreeCounts(const std::vector<BuildNode>& shape) {
+        std::vector<int32_t> counts(shape.size(), 1);
+        for (size_t i = shape.size(); i-- > 0;) {
+            if (shape[i].left != kNull) counts[i] += counts[shape[i].left];
+            if (shape[i].right != kNull) counts[i] += counts[shape[i].right];
+        }
+        return counts;
+    }
+
+    static std::vector<FleetMask> subtreeFleets(const std::vector<BuildNode>& shape, const std::vector<Driver>& drivers) {
+        std::vector<FleetMask> fleets(shape.size());
+        for (size_t i = shape.size(); i-- > 0;) {
+            fleets[i] = fleetBit(drivers[shape[i].item].fleet);
+            if (shape[i].left != kNull) fleets[i] |= fleets[shape[i].left];
+            if (shape[i].right != kNull) fleets[i] |= fleets[shape[i].right];
+        }
+        return fleets;
+    }
+
+    // Emit the top `levels` levels under `subtree` in van Emde Boas order: the
+    // upper half as one block, then each tree hanging below it as its own block.
+    // Recursion depth is O(log log n).
+    static void appendVanEmdeBoas(const std::vector<BuildNode>& shape, int32_t subtree, int levels,
+                                  std::vector<int32_t>& order) {
+        if (levels == 1) {
+            order.push_back(subtree);
+            return;
+        }
+        int topLevels = levels / 2;
+        appendVanEmdeBoas(shape, subtree, topLevels, order);
+
+        int bottomDepth = shape[subtree].depth + topLevels;
+        std::vector<int32_t> pending{subtree};
+        std::vector<int32_t> bottoms;
+        while (!pending.empty()) {
+            int32_t index = pending.back();
+            pending.pop_back();
+            if (shape[index].depth == bottomDepth) {
+                bottoms.push_back(index);
+                continue;
+            }
+            if (shape[index].right != kNull) pending.push_back(shape[index].right);
+            if (shape[index].left != kNull) pending.push_back(shape[index].left);
+        }
+        for (int32_t bottom : bottoms) {
+            appendVanEmdeBoas(shape, bottom, levels - topLevels, order);
+        }
+    }
+
+    static std::vector<int32_t> layoutOrder(const std::vector<BuildNode>& shape, NodeLayout layout) {
+        std::vector<int32_t> order;
+        order.reserve(shape.size());
+        if (shape.empty()) return order;
+
+        switch (layout) {
+        case NodeLayout::DepthFirst: {
+            std::vector<int32_t> pending{0};
+            while (!pending.empty()) {
+                int32_t index = pending.back();
+                pending.pop_back();
+                order.push_back(index);
+                if (shape[index].right != kNull) pending.push_back(shape[index].right);
+                if (shape[index].left != kNull) pending.push_back(shape[index].left);
+            }
+            break;
+        }
+        case NodeLayout::BreadthFirst:
+            order.push_back(0);
+            for (size_t head = 0; head < order.size(); ++head) {
+                const BuildNode& node = shape[order[head]];
+                if (node.left != kNull) order.push_back(node.left);
+                if (node.right != kNull) order.push_back(node.right);
+            }
+            break;
+        case NodeLayout::VanEmdeBoas: {
+            int height = 0;
+            for (const BuildNode& node : shape) height = std::max(height, node.depth + 1);
+            appendVanEmdeBoas(shape, 0, height, order);
+            break;
+        }
+        }
+        return order;
+    }
+
+    static bool overCompactionRatio(const KDNode& node) {
+        return node.count >= kMinRebuildSize &&
+               static_cast<size_t>(node.dead) * 100 >= static_cast<size_t>(node.count) * kCompactPercent;
+    }
+
+    // The parent's child link (or the root) that points at `index`
+    int32_t& linkTo(int32_t index) {
+        int32_t parent = nodes[index].parent;
+        if (parent == kNull) return root;
+        return nodes[parent].left == index ? nodes[parent].left : nodes[parent].right;
+    }
+
+    // Delete the driver stored at `index` without restructuring anything. A
+    // leaf is cut off, together with any tombstoned parents it leaves
+    // childless; an inner node becomes a tombstone. Only the counts on the
+    // way up change.
+    void markDeleted(int32_t index) {
+        nodeById.erase(nodes[index].driver.id);
+        nodes[index].deleted = true;
+
+        int32_t cut = 0;
+        while (index != kNull && nodes[index].deleted &&
+               nodes[index].left == kNull && nodes[index].right == kNull) {
+            int32_t parent = nodes[index].parent;
+            linkTo(index) = kNull;
+            releaseNode(index);
+            ++cut;
+            index = parent;
+        }
+        // One tombstone was added and `cut` of them went away with their slots
+        for (; index != kNull; index = nodes[index].parent) {
+            KDNode& node = nodes[index];
+            node.count -= cut;
+            node.dead += 1 - cut;
+            compactionDue |= overCompactionRatio(node);
+        }
+    }
+
+    // Safety net for trees nobody compacts in the background
+    void collapseIfMostlyDead() {
+        if (root != kNull &&
+            static_cast<size_t>(nodes[root].dead) * 100 >= static_cast<size_t>(nodes[root].count) * kCollapsePercent) {
+            compact();
+        }
+    }
+
+    // One half of a batched change: a driver leaving the node `origin`, or
+    // arriving at a position when `origin` is kNull
+    struct BatchEvent {
+        size_t update;
+        int32_t origin;
+        double lat;
+        double lng;
+    };
+
+    // Replace the subtree at `top` with a balanced one over its live drivers,
+    // minus those leaving and plus those arriving in `events`, reusing its slots.
+    // An arrival whose driver still sits elsewhere in the tree is left for the
+    // fallback path so no id is ever stored twice.
+    void rebuildSubtree(int32_t top, std::span<const Update> updates, std::span<const BatchEvent> events,
+                        std::vector<uint8_t>& departing, std::vector<uint8_t>& arriving) {
+        int32_t parent = nodes[top].parent;
+        bool asLeft = parent != kNull && nodes[parent].left == top;
+        int depth = nodes[top].depth;
+
+        // Leaving nodes are flagged with a zero count; every count below `top` is rewritten anyway
+        for (const BatchEvent& event : events) {
+            if (event.origin == kNull) continue;
+            nodes[event.origin].count = 0;
+            nodeById.erase(nodes[event.origin].driver.id);
+            departing[event.update] = 0;
+        }
+
+        std::vector<int32_t> slots;
+        std::vector<Driver> drivers;
+        InlineStack<int32_t, kInlineStackDepth> pending;
+        pending.push(top);
+        while (!pending.empty()) {
+            int32_t index = pending.pop();
+            KDNode& node = nodes[index];
+            slots.push_back(index);
+            if (node.count != 0 && !node.deleted) {
+                drivers.push_back(std::move(node.driver));
+            }
+            if (node.left != kNull) pending.push(node.left);
+            if (node.right != kNull) pending.push(node.right);
+        }
+        for (const BatchEvent& event : events) {
+            if (event.origin != kNull || departing[event.update]) continue;
+            drivers.push_back(updates[event.update].driver);
+            arriving[event.update] = 0;
+        }
+
+        std::vector<BuildPoint> points = buildPoints(drivers);
+        std::vector<BuildNode> shape;
+        shape.reserve(drivers.size());
+        std::vector<BuildRange> work;
+        if (!drivers.empty()) work.push_back({0, drivers.size(), depth, kNull, false});
+        splitRanges(points, work, shape, 0, nullptr);
+        std::vector<int32_t> counts = subtreeCounts(shape);
+        std::vector<FleetMask> fleets = subtreeFleets(shape, drivers);
+
+        while (slots.size() < shape.size()) {
+            slots.push_back(allocateNode(Driver{}, depth));
+        }
+        for (size_t i = shape.size(); i < slots.size(); ++i) {
+            releaseNode(slots[i]);
+        }
+        slots.resize(shape.size());
+        std::sort(slots.begin(), slots.end());
+
+        for (size_t i = 0; i < shape.size(); ++i) {
+            const BuildNode& built = shape[i];
+            KDNode& node = nodes[slots[i]];
+            node = KDNode(std::move(drivers[built.item]), built.depth);
+            node.count = counts[i];
+            node.fleets = fleets[i];
+            if (i == 0) node.parent = parent;
+            node.left = built.left == kNull ? kNull : slots[built.left];
+            node.right = built.right == kNull ? kNull : slots[built.right];
+            nodeById[node.driver.id] = slots[i];
+        }
+        for (size_t i = 0; i < shape.size(); ++i) {
+            if (shape[i].left != kNull) nodes[slots[shape[i].left]].parent = slots[i];
+            if (shape[i].right != kNull) nodes[slots[shape[i].right]].parent = slots[i];
+        }
+
+        int32_t replacement = shape.empty() ? kNull : slots[0];
+        if (parent == kNull) {
+            root = replacement;
+        } else if (asLeft) {
+            nodes[parent].left = replacement;
+        } else {
+            nodes[parent].right = replacement;
+        }
+    }
+
+    // Route every event down the tree at once, so upper levels are visited
+    // once per batch instead of once per change. Subtrees that changed enough
+    // are rebuilt, and a leaf whose driver stays inside its own cell is
+    // updated in place. Whatever is still flagged in `departing`/`arriving`
+    // afterwards needs an ordinary erase/insert.
+    void routeBatch(std::span<const Update> updates, std::vector<BatchEvent>& events,
+                    std::vector<uint8_t>& departing, std::vector<uint8_t>& arriving) {
+        struct Range {
+            int32_t node;
+            size_t begin;
+            size_t end;
+        };
+        std::vector<Range> work;
+        std::vector<int32_t> visited;
+        if (root != kNull && !events.empty()) work.push_back({root, 0, events.size()});
+
+        while (!work.empty()) {
+            Range range = work.back();
+            work.pop_back();
+            auto first = events.begin() + range.begin;
+            auto last = events.begin() + range.end;
+
+            const KDNode& node = nodes[range.node];
+            if (node.count >= kMinRebuildSize &&
+                (range.end - range.begin) * 100 >= static_cast<size_t>(node.count) * kRebuildPercent) {
+                rebuildSubtree(range.node, updates, std::span<const BatchEvent>(&*first, last - first),
+                               departing, arriving);
+                continue;
+            }
+            visited.push_back(range.node);
+
+            int32_t self = range.node;
+            int axis = node.depth & 1;
+            double split = axisValue(node.driver, axis);
+            int32_t left = node.left;
+            int32_t right = node.right;
+            auto goesLeft = [axis, split](const BatchEvent& event) {
+                return (axis ? event.lng : event.lat) < split;
+            };
+
+            // Events ending here: this node's own departure, and arrivals with no child on their side
+            auto passing = std::partition(first, last, [&](const BatchEvent& event) {
+                if (event.origin != kNull) return event.origin == self;
+                return (goesLeft(event) ? left : right) == kNull;
+            });
+            auto rightBegin = std::partition(passing, last, goesLeft);
+
+            if (left == kNull && right == kNull) {
+                for (auto leave = first; leave != passing; ++leave) {
+                    if (leave->origin != self) continue;
+                    for (auto arrive = first; arrive != passing; ++arrive) {
+                        if (arrive->origin == kNull && arrive->update == leave->update) {
+                            nodes[self].driver = updates[leave->update].driver;
+                            departing[leave->update] = 0;
+                            arriving[leave->update] = 0;
+                        }
+                    }
+                }
+            }
+
+            size_t split1 = static_cast<size_t>(passing - events.begin());
+            size_t split2 = static_cast<size_t>(rightBegin - events.begin());
+            if (split2 < range.end) work.push_back({right, split2, range.end});
+            if (split1 < split2) work.push_back({left, split1, split2});
+        }
+
+        // Rebuilt subtrees may have changed size; children come after parents in `visited`
+        for (auto it = visited.rbegin(); it != visited.rend(); ++it) {
+            KDNode& node = nodes[*it];
+            node.count = 1 + (node.left != kNull ? nodes[node.left].count : 0)
+                           + (node.right != kNull ? nodes[node.right].count : 0);
+            node.dead = node.deleted + (node.left != kNull ? nodes[node.left].dead : 0)
+                                     + (node.right != kNull ? nodes[node.right].dead : 0);
+            node.fleets = (node.deleted ? 0 : fleetBit(node.driver.fleet))
+                        | (node.left != kNull ? nodes[node.left].fleets : 0)
+                        | (node.right != kNull ? nodes[node.right].fleets : 0);
+        }
+    }
+
+    // A deferred subtree in a fenced search, with the cell its splitting
+    // planes bound it to and how that cell lies against the fence
+    struct FencedFrame {
+        int32_t node;
+        double bound;
+        double cell[2][2];
+        FenceCover cover;
+    };
+
+    // Nearest search restricted to one side of `fence`. The cell of each
+    // subtree is narrowed on the way down and classified only while it
+    // straddles the fence: a cell wholly on the unwanted side is pruned, one
+    // wholly on the wanted side is searched with no per-point tests.
+    // `offer(dist, driver)` takes each candidate and `limit()` is the current
+    // k-th distance, or infinity while fewer than k are held.
+    template <typename Offer, typename Limit>
+    void walkFenced(const double target[2], const Geofence& fence, FenceMode mode,
+                    Offer&& offer, Limit&& limit) const {
+        if (root == kNull) return;
+        FenceCover wanted = mode == FenceMode::Inside ? FenceCover::Inside : FenceCover::Outside;
+        InlineStack<FencedFrame, kInlineStackDepth> pending;
+        pending.push({root, 0.0, {{-90.0, 90.0}, {-180.0, 180.0}}, FenceCover::Straddling});
+        while (!pending.empty()) {
+            FencedFrame frame = pending.pop();
+            if (frame.bound >= limit()) continue;
+
+            for (int32_t index = frame.node; index != kNull;) {
+                const KDNode& node = nodes[index];
+                if (node.dead == node.count) break;
+                if (frame.cover == FenceCover::Straddling) {
+                    frame.cover = fence.cover(frame.cell[0][0], frame.cell[0][1], frame.cell[1][0], frame.cell[1][1]);
+                }
+                if (frame.cover != FenceCover::Straddling && frame.cover != wanted) break;
+                prefetchNode(node.left);
+                prefetchNode(node.right);
+
+                if (node.driver.available && !node.deleted &&
+                    (frame.cover == wanted || fence.contains(node.driver.lat, node.driver.lng) == (mode == FenceMode::Inside))) {
+                    offer(squaredDistance(target[0], target[1], node.driver.lat, node.driver.lng), node.driver);
+                }
+
+                int axis = node.depth & 1;
+                double split = axisValue(node.driver, axis);
+                double diff = target[axis] - split;
+                int32_t nearChild = diff < 0 ? node.left : node.right;
+                int32_t farChild = diff < 0 ? node.right : node.left;
+                // Equal coordinates can sit on either side after a median
+                // build, so both cells keep the splitting plane
+                if (farChild != kNull) {
+                    FencedFrame far = frame;
+                    far.node = farChild;
+                    far.bound = farSideBound(target, axis, diff);
+                    far.cell[axis][diff < 0 ? 0 : 1] = split;
+                    pending.push(far);
+                }
+                frame.cell[axis][diff < 0 ? 1 : 0] = split;
+                index = nearChild;
+            }
+        }
+    }
+
+    // Nearest search over drivers of the fleets in `fleets`. A subtree whose
+    // mask holds none of them is dropped on arrival, so one tenant's queries
+    // never scan another's drivers beyond the nodes they share a path with.
+    template <typename Offer, typename Limit>
+    void walkFleets(const double target[2], FleetMask fleets, Offer&& offer, Limit&& limit) const {
+        if (root == kNull) return;
+        InlineStack<SearchFrame, kInlineStackDepth> pending;
+        pending.push({root, 0.0});
+        while (!pending.empty()) {
+            SearchFrame frame = pending.pop();
+            if (frame.bound >= limit()) continue;
+
+            for (int32_t index = frame.node; index != kNull;) {
+                const KDNode& node = nodes[index];
+                if (node.dead == node.count || (node.fleets & fleets) == 0) break;
+                prefetchNode(node.left);
+                prefetchNode(node.right);
+
+                if (node.driver.available && !node.deleted && (fleetBit(node.driver.fleet) & fleets)) {
+                    offer(squaredDistance(target[0], target[1], node.driver.lat, node.driver.lng), node.driver);
+                }
+
+                int axis = node.depth & 1;
+                double diff = target[axis] - axisValue(node.driver, axis);
+                int32_t nearChild = diff < 0 ? node.left : node.right;
+                int32_t farChild = diff < 0 ? node.right : node.left;
+                if (farChild != kNull) pending.push({farChild, farSideBound(target, axis, diff)});
+                index = nearChild;
+            }
+        }
+    }
+
+public:
+    KDTree() : root(kNull) {}
+
+    // Squared distance in degrees, taking the shorter way round in longitude
+    // so 179.99 and -179.99 are neighbours
+    static double squaredDistance(double lat1, double lng1, double lat2, double lng2) {
+        double dlat = lat2 - lat1;
+        double dlng = std::abs(lng2 - lng1);
+        dlng = std::min(dlng, 360.0 - dlng);
+        return dlat * dlat + dlng * dlng;
+    }
+
+    // Bulk builds and batch queries fan out over `workers` when set; the pool
+    // must outlive the tree or be detached with nullptr.
+    void setThreadPool(ThreadPool* workers) {
+        pool = workers;
+    }
+
+    // Insert a driver, replacing any earlier entry with the same id
+    void insert(const Driver& driver) {
+        checkedFleet(driver.fleet);
+        auto existing = nodeById.find(driver.id);
+        if (existing != nodeById.end()) {
+            markDeleted(existing->second);
+            collapseIfMostlyDead();
+        }
+
+        int32_t parent = kNull;
+        bool asLeft = false;
+        int depth = 0;
+        for (int32_t index = root; index != kNull; ++depth) {
+            KDNode& node = nodes[index];
+            int axis = depth & 1;
+            ++node.count;
+            node.fleets |= fleetBit(driver.fleet);
+            parent = index;
+            asLeft = axisValue(driver, axis) < axisValue(node.driver, axis);
+            index = asLeft ? node.left : node.right;
+        }
+
+        int32_t created = allocateNode(driver, depth);
+        nodes[created].parent = parent;
+        nodeById[driver.id] = created;
+        if (parent == kNull) {
+            root = created;
+        } else if (asLeft) {
+            nodes[parent].left = created;
+        } else {
+            nodes[parent].right = created;
+        }
+    }
+
+    // Replace the contents with a balanced tree over `drivers`, laid out in
+    // memory according to `layout`. Meant for snapshots that are rebuilt
+    // wholesale rather than mutated.
+    void build(std::vector<Driver> drivers, NodeLayout layout = NodeLayout::DepthFirst) {
+        for (const Driver& driver : drivers) checkedFleet(driver.fleet);
+        std::vector<BuildNode> shape = buildShape(drivers);
+        std::vector<int32_t> order = layoutOrder(shape, layout);
+
+        std::vector<int32_t> position(shape.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            position[order[i]] = static_cast<int32_t>(i);
+        }
+
+        std::vector<int32_t> counts = subtreeCounts(shape);
+        std::vector<FleetMask> fleets = subtreeFleets(shape, drivers);
+        // Room for the inserts that pile up next to tombstones before compaction,
+        // so the first few after a build do not reallocate the whole pool
+        std::vector<KDNode> laidOut;
+        laidOut.reserve(shape.size() + shape.size() * kCompactPercent / 100);
+        for (int32_t logical : order) {
+            const BuildNode& node = shape[logical];
+            laidOut.emplace_back(std::move(drivers[node.item]), node.depth);
+            laidOut.back().count = counts[logical];
+            laidOut.back().fleets = fleets[logical];
+            laidOut.back().left = node.left == kNull ? kNull : position[node.left];
+            laidOut.back().right = node.right == kNull ? kNull : position[node.right];
+        }
+
+        nodeById.clear();
+        nodeById.reserve(laidOut.size());
+        for (size_t i = 0; i < laidOut.size(); ++i) {
+            int32_t self = static_cast<int32_t>(i);
+            if (laidOut[i].left != kNull) laidOut[laidOut[i].left].parent = self;
+            if (laidOut[i].right != kNull) laidOut[laidOut[i].right].parent = self;
+            nodeById[laidOut[i].driver.id] = self;
+        }
+
+        nodes = std::move(laidOut);
+        freeSlots.clear();
+        compactionDue = false;
+        root = nodes.empty() ? kNull : position[0];
+    }
+
+    // Find k nearest neighbors
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        NearestSearch search;
+        beginSearch(search, targetLat, targetLng, k > 0 ? static_cast<size_t>(k) : 0);
+        while (stepSearch(search)) {}
+        return collectResult(search);
+    }
+
+    // Fill `out` with the out.size() nearest available drivers, closest first,
+    // and return how many were found. Nothing is allocated unless the tree is
+    // deeper than the inline traversal stack.
+    size_t findNearestNeighbors(double targetLat, double targetLng, std::span<Neighbor> out) const {
+        size_t filled = 0;
+        if (root == kNull || out.empty()) return 0;
+
+        const double target[2] = {targetLat, targetLng};
+        InlineStack<SearchFrame, kInlineStackDepth> pending;
+        pending.push({root, 0.0});
+        while (!pending.empty()) {
+            SearchFrame frame = pending.pop();
+            if (filled == out.size() && frame.bound >= out[filled - 1].distanceSq) continue;
+
+            for (int32_t index = frame.node; index != kNull;) {
+                const KDNode& node = nodes[index];
+                if (node.dead == node.count) break;
+                prefetchNode(node.left);
+                prefetchNode(node.right);
+
+                if (node.driver.available && !node.deleted) {
+                    double dist = squaredDistance(targetLat, targetLng, node.driver.lat, node.driver.lng);
+                    offerNeighbor(out, filled, dist, node.driver.id);
+                }
+
+                int axis = node.depth & 1;
+                double diff = target[axis] - axisValue(node.driver, axis);
+                int32_t nearChild = diff < 0 ? node.left : node.right;
+                int32_t farChild = diff < 0 ? node.right : node.left;
+                if (farChild != kNull) pending.push({farChild, farSideBound(target, axis, diff)});
+                index = nearChild;
+            }
+        }
+        return filled;
+    }
+
+    // The k nearest available drivers inside `fence`, or outside it with
+    // FenceMode::Outside, closest first
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k,
+                                             const Geofence& fence, FenceMode mode = FenceMode::Inside) const {
+        std::vector<std::pair<double, Driver>> nearest;
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        if (limit > 0) {
+            const double target[2] = {targetLat, targetLng};
+            walkFenced(target, fence, mode,
+                [&](double dist, const Driver& driver) { offerCandidate(nearest, limit, dist, driver); },
+                [&] { return nearest.size() < limit ? std::numeric_limits<double>::infinity() : nearest.back().first; });
+        }
+        std::vector<Driver> result;
+        result.reserve(nearest.size());
+        for (const auto& entry : nearest) result.push_back(entry.second);
+        return result;
+    }
+
+    // Fenced variant of the span overload
+    size_t findNearestNeighbors(double targetLat, double targetLng, const Geofence& fence, FenceMode mode,
+                                std::span<Neighbor> out) const {
+        size_t filled = 0;
+        if (out.empty()) return 0;
+        const double target[2] = {targetLat, targetLng};
+        walkFenced(target, fence, mode,
+            [&](double dist, const Driver& driver) { offerNeighbor(out, filled, dist, driver.id); },
+            [&] { return filled < out.size() ? std::numeric_limits<double>::infinity() : out[filled - 1].distanceSq; });
+        return filled;
+    }
+
+    // The k nearest available drivers belonging to any fleet in `fleets`
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k, FleetMask fleets) const {
+        std::vector<std::pair<double, Driver>> nearest;
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        if (limit > 0) {
+            const double target[2] = {targetLat, targetLng};
+            walkFleets(target, fleets,
+                [&](double dist, const Driver& driver) { offerCandidate(nearest, limit, dist, driver); },
+                [&] { return nearest.size() < limit ? std::numeric_limits<double>::infinity() : nearest.back().first; });
+        }
+        std::vector<Driver> result;
+        result.reserve(nearest.size());
+        for (const auto& entry : nearest) result.push_back(entry.second);
+        return result;
+    }
+
+    size_t findNearestNeighbors(double targetLat, double targetLng, FleetMask fleets, std::span<Neighbor> out) const {
+        size_t filled = 0;
+        if (out.empty()) return 0;
+        const double target[2] = {targetLat, targetLng};
+        walkFleets(target, fleets,
+            [&](double dist, const Driver& driver) { offerNeighbor(out, filled, dist, driver.id); },
+            [&] { return filled < out.size() ? std::numeric_limits<double>::infinity() : out[filled - 1].distanceSq; });
+        return filled;
+    }
+
+    // Context variants of the span overloads; the result lives in `context`
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(k > 0 ? static_cast<size_t>(k) : 0);
+        return out.first(findNearestNeighbors(targetLat, targetLng, out));
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, const Geofence& fence,
+                                             FenceMode mode, QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(k > 0 ? static_cast<size_t>(k) : 0);
+        return out.first(findNearestNeighbors(targetLat, targetLng, fence, mode, out));
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, FleetMask fleets,
+                                             QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(k > 0 ? static_cast<size_t>(k) : 0);
+        return out.first(findNearestNeighbors(targetLat, targetLng, fleets, out));
+    }
+
+    // Results for query i are element i; with a pool attached the fan-out
+    // itself still allocates its tasks
+    std::span<const std::span<Neighbor>> findNearestNeighborsBatch(
+        const std::vector<Query>& queries, int k, QueryContext& context) const {
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        std::span<std::span<Neighbor>> results = context.allocate<std::span<Neighbor>>(queries.size());
+        std::span<Neighbor> hits = context.allocate<Neighbor>(queries.size() * limit);
+        auto runRange = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                std::span<Neighbor> slot = hits.subspan(i * limit, limit);
+                results[i] = slot.first(findNearestNeighbors(queries[i].lat, queries[i].lng, slot));
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor(queries.size(), kQueriesPerTask, runRange);
+        } else {
+            runRange(0, queries.size());
+        }
+        return results;
+    }
+
+    // Same as findNearestNeighbors, keeping each driver's squared distance so
+    // results from several sources can be merged. Without allocating, the
+    // context overload of findNearestNeighbors carries the same distances in
+    // each Neighbor.
+    std::vector<std::pair<double, Driver>> findNearestNeighborsWithDistance(
+        double targetLat, double targetLng, int k) const {
+        NearestSearch search;
+        beginSearch(search, targetLat, targetLng, k > 0 ? static_cast<size_t>(k) : 0);
+        while (stepSearch(search)) {}
+        return std::move(search.nearest);
+    }
+
+    // Find k nearest neighbors for many riders at once. A handful of searches
+    // are kept in flight and advanced round-robin, so the prefetches one
+    // issues land while the others run; with a thread pool attached, chunks
+    // of the batch run on different workers.
+    std::vector<std::vector<Driver>> findNearestNeighborsBatch(
+        const std::vector<Query>& queries,
+        int k,
+        BatchStrategy strategy = BatchStrategy::Stepped
+    ) const {
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        std::vector<std::vector<Driver>> results(queries.size());
+        auto runRange = [&](size_t begin, size_t end) {
+            if (strategy == BatchStrategy::Coroutine) {
+                batchCoroutines(queries.data() + begin, end - begin, limit, results.data() + begin);
+            } else {
+                batchStepped(queries.data() + begin, end - begin, limit, results.data() + begin);
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor(queries.size(), kQueriesPerTask, runRange);
+        } else {
+            runRange(0, queries.size());
+        }
+        return results;
+    }
+
+    // All available drivers within `radius` of the target, in no particular order
+    std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radius) const {
+        std::vector<Driver> result;
+        if (root == kNull || radius < 0) return result;
+
+        const double target[2] = {targetLat, targetLng};
+        const double radiusSq = radius * radius;
+        InlineStack<int32_t, kInlineStackDepth> pending;
+        pending.push(root);
+
+        while (!pending.empty()) {
+            const KDNode& node = nodes[pending.pop()];
+            if (node.dead == node.count) continue;
+            if (node.driver.available && !node.deleted &&
+                squaredDistance(targetLat, targetLng, node.driver.lat, node.driver.lng) <= radiusSq) {
+                result.push_back(node.driver);
+            }
+
+            int axis = node.depth & 1;
+            double diff = target[axis] - axisValue(node.driver, axis);
+            // Only cross the splitting plane when the circle reaches over it
+            bool crosses = farSideBound(target, axis, diff) <= radiusSq;
+            if (node.left != kNull && (diff < 0 || crosses)) pending.push(node.left);
+            if (node.right != kNull && (diff >= 0 || crosses)) pending.push(node.right);
+        }
+        return result;
+    }
+
+    // Write available drivers within `radius` into `out`, in no particular
+    // order, and return how many there are in total; only the first
+    // out.size() of them are written. Allocation-free like the kNN overload.
+    size_t findWithinRadius(double targetLat, double targetLng, double radius, std::span<Neighbor> out) const {
+        size_t total = 0;
+        if (root == kNull || radius < 0) return 0;
+
+        const double target[2] = {targetLat, targetLng};
+        const double radiusSq = radius * radius;
+        InlineStack<int32_t, kInlineStackDepth> pending;
+        pending.push(root);
+        while (!pending.empty()) {
+            const KDNode& node = nodes[pending.pop()];
+            if (node.dead == node.count) continue;
+            if (node.driver.available && !node.deleted) {
+                double dist = squaredDistance(targetLat, targetLng, node.driver.lat, node.driver.lng);
+                if (dist <= radiusSq) {
+                    if (total < out.size()) out[total] = {node.driver.id, dist};
+                    ++total;
+                }
+            }
+
+            int axis = node.depth & 1;
+            double diff = target[axis] - axisValue(node.driver, axis);
+            bool crosses = farSideBound(target, axis, diff) <= radiusSq;
+            if (node.left != kNull && (diff < 0 || crosses)) pending.push(node.left);
+            if (node.right != kNull && (diff >= 0 || crosses)) pending.push(node.right);
+        }
+        return total;
+    }
+
+    // Sized from a first guess; a denser area costs one more pass at the exact size
+    std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radius, QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(kRadiusGuess);
+        size_t total = findWithinRadius(targetLat, targetLng, radius, out);
+        if (total > out.size()) {
+            out = context.allocate<Neighbor>(total);
+            findWithinRadius(targetLat, targetLng, radius, out);
+        }
+        return out.first(total);
+    }
+
+    // Radius scans for many riders, spread over the thread pool when one is attached
+    std::vector<std::vector<Driver>> findWithinRadiusBatch(const std::vector<Query>& queries, double radius) const {
+        std::vector<std::vector<Driver>> results(queries.size());
+        auto runRange = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                results[i] = findWithinRadius(queries[i].lat, queries[i].lng, radius);
+            }
+        };
+
+        if (pool) {
+            pool->parallelFor(queries.size(), kQueriesPerTask, runRange);
+        } else {
+            runRange(0, queries.size());
+        }
+        return results;
+    }
+
+    // Context variant, hits for query i being element i. A counting pass
+    // sizes one block for every rider's hits and a second pass fills it, so
+    // workers never share the context; the fan-out still allocates its tasks.
+    std::span<const std::span<Neighbor>> findWithinRadiusBatch(const std::vector<Query>& queries, double radius,
+                                                               QueryContext& context) const {
+        std::span<std::span<Neighbor>> results = context.allocate<std::span<Neighbor>>(queries.size());
+        std::span<size_t> totals = context.allocate<size_t>(queries.size());
+        auto spread = [&](auto&& runRange) {
+            if (pool) {
+                pool->parallelFor(queries.size(), kQueriesPerTask, runRange);
+            } else {
+                runRange(0, queries.size());
+            }
+        };
+
+        spread([&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                totals[i] = findWithinRadius(queries[i].lat, queries[i].lng, radius, std::span<Neighbor>());
+            }
+        });
+        size_t sum = 0;
+        for (size_t total : totals) sum += total;
+        std::span<Neighbor> hits = context.allocate<Neighbor>(sum);
+        for (size_t i = 0, offset = 0; i < queries.size(); offset += totals[i++]) {
+            results[i] = hits.subspan(offset, totals[i]);
+        }
+        spread([&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) findWithinRadius(queries[i].lat, queries[i].lng, radius, results[i]);
+        });
+        return results;
+    }
+
+    // Delete a driver, found by id wherever it currently is. Nothing is
+    // restructured: leaves are cut off and inner nodes tombstoned; see compact().
+    void remove(const Driver& driver) {
+        auto found = nodeById.find(driver.id);
+        if (found != nodeById.end()) {
+            markDeleted(found->second);
+            collapseIfMostlyDead();
+        }
+    }
+
+    // Update a driver's position
+    void update(const Driver& driver) {
+        remove(driver);
+        insert(driver);
+    }
+
+    // Apply many changes in one pass, e.g. a whole GPS window. Only the last
+    // change per driver counts. Changes that leave a position untouched are
+    // written straight into the node; the rest are routed down the tree
+    // together (see routeBatch) and only stragglers pay a tombstone plus insert.
+    void applyBatch(std::span<const Update> updates) {
+        // Checked up front so a bad fleet leaves the tree untouched
+        for (const Update& update : updates) {
+            if (update.kind == UpdateKind::Upsert) checkedFleet(update.driver.fleet);
+        }
+        std::unordered_map<int, size_t> latest;
+        latest.reserve(updates.size());
+        for (size_t i = 0; i < updates.size(); ++i) {
+            latest[updates[i].driver.id] = i;
+        }
+
+        std::vector<BatchEvent> events;
+        events.reserve(updates.size() * 2);
+        std::vector<uint8_t> departing(updates.size(), 0);
+        std::vector<uint8_t> arriving(updates.size(), 0);
+        for (size_t i = 0; i < updates.size(); ++i) {
+            const Update& change = updates[i];
+            if (latest[change.driver.id] != i) continue;
+
+            auto found = nodeById.find(change.driver.id);
+            bool upsert = change.kind == UpdateKind::Upsert;
+            if (found != nodeById.end()) {
+                KDNode& node = nodes[found->second];
+                if (upsert && node.driver.lat == change.driver.lat && node.driver.lng == change.driver.lng) {
+                    node.driver = change.driver;
+                    // A new fleet has to show in every mask on the way up
+                    FleetMask bit = fleetBit(change.driver.fleet);
+                    for (int32_t at = found->second; at != kNull && !(nodes[at].fleets & bit); at = nodes[at].parent) {
+                        nodes[at].fleets |= bit;
+                    }
+                    continue;
+                }
+                events.push_back({i, found->second, node.driver.lat, node.driver.lng});
+                departing[i] = 1;
+            }
+            if (upsert) {
+                events.push_back({i, kNull, change.driver.lat, change.driver.lng});
+                arriving[i] = 1;
+            }
+        }
+
+        routeBatch(updates, events, departing, arriving);
+
+        // Routing left the events grouped by the cell they ended in, so the
+        // stragglers are handled in that order and their walks share cache lines
+        for (const BatchEvent& event : events) {
+            size_t i = event.update;
+            if (departing[i]) {
+                markDeleted(nodeById.at(updates[i].driver.id));
+                departing[i] = 0;
+            }
+            if (arriving[i]) {
+                insert(updates[i].driver);
+                arriving[i] = 0;
+            }
+        }
+        collapseIfMostlyDead();
+    }
+
+    // Whether some subtree has enough tombstones that compact() would rebuild it
+    bool needsCompaction() const {
+        return compactionDue;
+    }
+
+    // Rebuild every outermost subtree whose tombstone ratio crosses
+    // kCompactPercent, dropping its tombstones. Cost is proportional to the
+    // rebuilt subtrees, so it suits a maintenance task between query bursts.
+    // Returns the number of tombstones reclaimed.
+    size_t compact() {
+        compactionDue = false;
+        size_t reclaimed = 0;
+        std::vector<int32_t> work;
+        if (root != kNull) work.push_back(root);
+        while (!work.empty()) {
+            int32_t index = work.back();
+            work.pop_back();
+            const KDNode& node = nodes[index];
+            if (node.dead == 0) continue;
+            if (!overCompactionRatio(node)) {
+                if (node.left != kNull) work.push_back(node.left);
+                if (node.right != kNull) work.push_back(node.right);
+                continue;
+            }
+
+            int32_t parent = node.parent;
+            int32_t dropped = node.dead;
+            std::vector<uint8_t> none;
+            rebuildSubtree(index, {}, {}, none, none);
+            for (; parent != kNull; parent = nodes[parent].parent) {
+                nodes[parent].count -= dropped;
+                nodes[parent].dead -= dropped;
+            }
+            reclaimed += static_cast<size_t>(dropped);
+        }
+        return reclaimed;
+    }
+
+    size_t tombstoneCount() const {
+        return root == kNull ? 0 : static_cast<size_t>(nodes[root].dead);
+    }
+
+    size_t size() const {
+        return nodeById.size();
+    }
+
+    bool contains(int id) const {
+        return nodeById.count(id) != 0;
+    }
+
+    // The stored driver with this id, e.g. to resolve a Neighbor; valid
+    // until the next change to the tree
+    const Driver* driverById(int id) const {
+        auto found = nodeById.find(id);
+        return found == nodeById.end() ? nullptr : &nodes[found->second].driver;
+    }
+
+    // Copy of every driver in the tree, in no particular order (nodeById's
+    // hash order; free slots can still hold stale drivers, so `nodes` can't be
+    // walked instead)
+    std::vector<Driver> snapshot() const {
+        std::vector<Driver> drivers;
+        drivers.reserve(nodeById.size());
+        for (const auto& [id, index] : nodeById) {
+            drivers.push_back(nodes[index].driver);
+        }
+        return drivers;
+    }
+};
+
+// Read-mostly index kept as one replica per NUMA node, each allocated on its
+// own node, so readers never walk nodes across the socket interconnect.
+// Readers are routed to the replica of the node they are running on; a single
+// writer fans every update batch out to all replicas.
+class ReplicatedIndex {
+private:
+    struct Replica {
+        mutable std::shared_mutex mutex;
+        KDTree tree;
+        // Guarded by compactionMutex
+        bool compacting = false;
+    };
+
+    NumaTopology topology;
+    std::vector<std::unique_ptr<Replica>> replicas;
+
+    ThreadPool* maintenance = nullptr;
+    std::mutex compactionMutex;
+    std::condition_variable compactionDone;
+    size_t compactionsRunning = 0;
+
+    const Replica& local() const {
+        size_t node = static_cast<size_t>(topology.currentNode());
+        return *replicas[node < replicas.size() ? node : 0];
+    }
+
+    // Run fn once per replica on a thread pinned to that replica's node. Linux
+    // places pages on the node that first touches them, so whatever fn
+    // allocates ends up local to the readers of that replica.
+    template <typename Fn>
+    void onEachNode(Fn&& fn) {
+        if (replicas.size() == 1) {
+            fn(*replicas[0]);
+            return;
+        }
+        std::vector<std::thread> writers;
+        for (size_t node = 0; node < replicas.size(); ++node) {
+            writers.emplace_back([this, node, &fn] {
+                pinCurrentThread(topology.nodeCpus[node]);
+                fn(*replicas[node]);
+            });
+        }
+        for (auto& writer : writers) writer.join();
+    }
+
+    // Hand replicas whose tombstones have piled up to the maintenance pool.
+    // A replica is locked for writing only while its own compaction runs.
+    void scheduleCompaction() {
+        if (!maintenance) return;
+        for (auto& owned : replicas) {
+            Replica* replica = owned.get();
+            {
+                std::shared_lock<std::shared_mutex> lock(replica->mutex);
+                if (!replica->tree.needsCompaction()) continue;
+            }
+            {
+                std::lock_guard<std::mutex> guard(compactionMutex);
+                if (replica->compacting) continue;
+                replica->compacting = true;
+                ++compactionsRunning;
+            }
+            maintenance->submit([this, replica] {
+                {
+                    std::unique_lock<std::shared_mutex> lock(replica->mutex);
+                    replica->tree.compact();
+                }
+                std::lock_guard<std::mutex> guard(compactionMutex);
+                replica->compacting = false;
+                --compactionsRunning;
+                compactionDone.notify_all();
+            }, TaskPriority::Maintenance);
+        }
+    }
+
+public:
+    // With `replicate` off there is a single shared copy, as on a one-socket box
+    explicit ReplicatedIndex(bool replicate = true) : topology(NumaTopology::detect()) {
+        size_t count = replicate ? topology.nodeCount() : 1;
+        for (size_t i = 0; i < count; ++i) {
+            replicas.push_back(std::make_unique<Replica>());
+        }
+    }
+
+    ~ReplicatedIndex() {
+        waitForCompaction();
+    }
+
+    size_t replicaCount() const { return replicas.size(); }
+
+    // Compact tombstoned subtrees as maintenance tasks on `workers` after
+    // each write batch; the pool must outlive the index
+    void setMaintenancePool(ThreadPool* workers) {
+        maintenance = workers;
+    }
+
+    // Block until no background compaction is running
+    void waitForCompaction() {
+        std::unique_lock<std::mutex> guard(compactionMutex);
+        compactionDone.wait(guard, [this] { return compactionsRunning == 0; });
+    }
+
+    // Rebuild every replica from a fresh snapshot of the drivers
+    void publish(const std::vector<Driver>& drivers, NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        onEachNode([&](Replica& replica) {
+            std::unique_lock<std::shared_mutex> lock(replica.mutex);
+            replica.tree.build(drivers, layout);
+        });
+    }
+
+    // Apply a batch of position updates to every replica. Each replica is
+    // locked only while its own copy is being updated.
+    void applyUpdates(const std::vector<Driver>& updates) {
+        std::vector<Update> batch;
+        batch.reserve(updates.size());
+        for (const Driver& driver : updates) {
+            batch.push_back({driver, UpdateKind::Upsert});
+        }
+        onEachNode([&](Replica& replica) {
+            std::unique_lock<std::shared_mutex> lock(replica.mutex);
+            replica.tree.applyBatch(batch);
+        });
+        scheduleCompaction();
+    }
+
+    // Take drivers out of every replica, e.g. at the end of a shift
+    void removeDrivers(const std::vector<int>& ids) {
+        std::vector<Update> batch;
+        batch.reserve(ids.size());
+        for (int id : ids) {
+            batch.push_back({Driver{id, 0.0, 0.0, {}, false}, UpdateKind::Remove});
+        }
+        onEachNode([&](Replica& replica) {
+            std::unique_lock<std::shared_mutex> lock(replica.mutex);
+            replica.tree.applyBatch(batch);
+        });
+        scheduleCompaction();
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findNearestNeighbors(targetLat, targetLng, k);
+    }
+
+    std::vector<std::vector<Driver>> findNearestNeighborsBatch(const std::vector<Query>& queries, int k) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findNearestNeighborsBatch(queries, k);
+    }
+
+    std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radius) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findWithinRadius(targetLat, targetLng, radius);
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findNearestNeighbors(targetLat, targetLng, k, context);
+    }
+
+    std::span<const std::span<Neighbor>> findNearestNeighborsBatch(const std::vector<Query>& queries, int k,
+                                                                   QueryContext& context) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findNearestNeighborsBatch(queries, k, context);
+    }
+
+    std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radius, QueryContext& context) const {
+        const Replica& replica = local();
+        std::shared_lock<std::shared_mutex> lock(replica.mutex);
+        return replica.tree.findWithinRadius(targetLat, targetLng, radius, context);
+    }
+};
+
+// Log-structured index: a large immutable base tree in vEB layout plus a
+// small mutable delta in front of it. Writes are O(1) hash updates to the
+// delta; reads merge the base (minus tombstoned drivers) with a linear scan of
+// the delta. Once the delta has taken enough writes it is frozen and folded
+// into a freshly built base, in the background when a thread pool is attached.
+class DeltaIndex {
+private:
+    // Drivers written since the layer below was frozen, kept contiguous so a
+    // query can scan them linearly. A tombstone hides an id in every older
+    // layer, whether it was moved or removed.
+    struct Delta {
+        std::vector<Driver> drivers;
+        // Coordinates of `drivers` kept apart so the distance scan stays in cache
+        std::vector<double> lats;
+        std::vector<double> lngs;
+        std::unordered_map<int, size_t> slotById;
+        std::unordered_set<int> tombstones;
+
+        void upsert(const Driver& driver) {
+            tombstones.insert(driver.id);
+            auto [slot, inserted] = slotById.try_emplace(driver.id, drivers.size());
+            if (inserted) {
+                drivers.push_back(driver);
+                lats.push_back(driver.lat);
+                lngs.push_back(driver.lng);
+            } else {
+                drivers[slot->second] = driver;
+                lats[slot->second] = driver.lat;
+                lngs[slot->second] = driver.lng;
+            }
+        }
+
+        void erase(int id) {
+            tombstones.insert(id);
+            auto found = slotById.find(id);
+            if (found == slotById.end()) return;
+            size_t slot = found->second;
+            slotById.erase(found);
+            if (slot + 1 != drivers.size()) {
+                drivers[slot] = std::move(drivers.back());
+                lats[slot] = lats.back();
+                lngs[slot] = lngs.back();
+                slotById[drivers[slot].id] = slot;
+            }
+            drivers.pop_back();
+            lats.pop_back();
+            lngs.pop_back();
+        }
+    };
+
+    // A writer that gets this many thresholds ahead of a running merge waits for it
+    static constexpr size_t kMaxBacklog = 4;
+
+    mutable std::shared_mutex mutex;
+    std::shared_ptr<const KDTree> base;
+    std::shared_ptr<const Delta> frozen;
+    Delta active;
+    bool closing = false;
+
+    size_t mergeThreshold;
+    ThreadPool* pool;
+    std::mutex mergeMutex;
+    std::condition_variable mergeDone;
+    bool merging = false;
+    // Bumped by build(), under `mutex`; a merge started in an older
+    // generation folded a base that no longer exists and is thrown away
+    uint64_t generation = 0;
+
+    static std::shared_ptr<const KDTree> foldLayer(const KDTree& oldBase, const Delta& layer) {
+        std::vector<Driver> drivers;
+        drivers.reserve(oldBase.size() + layer.drivers.size());
+        for (Driver& driver : oldBase.snapshot()) {
+            if (!layer.tombstones.count(driver.id)) drivers.push_back(std::move(driver));
+        }
+        drivers.insert(drivers.end(), layer.drivers.begin(), layer.drivers.end());
+
+        auto rebuilt = std::make_shared<KDTree>();
+        rebuilt->build(std::move(drivers), NodeLayout::VanEmdeBoas);
+        return rebuilt;
+    }
+
+    // Last thing a merge task does; notifying under the lock keeps a waiting
+    // destructor from tearing the index down underneath it
+    void finishMerge() {
+        std::lock_guard<std::mutex> guard(mergeMutex);
+        merging = false;
+        mergeDone.notify_all();
+    }
+
+    // Called with `mutex` held and `merging` already claimed
+    void freezeAndMerge() {
+        frozen = std::make_shared<const Delta>(std::move(active));
+        active = Delta();
+        pool->submit([this, oldBase = base, layer = frozen, started = generation] {
+            std::shared_ptr<const KDTree> rebuilt = foldLayer(*oldBase, *layer);
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            if (generation == started) {
+                base = std::move(rebuilt);
+                frozen.reset();
+            }
+            // Writes that piled up meanwhile may already warrant the next merge
+            if (!closing && active.tombstones.size() >= mergeThreshold) {
+                freezeAndMerge();
+                return;
+            }
+            lock.unlock();
+            finishMerge();
+        }, TaskPriority::Maintenance);
+    }
+
+    // Called with `lock` held on `mutex`
+    void maybeStartMerge(std::unique_lock<std::shared_mutex>& lock) {
+        if (closing || active.tombstones.size() < mergeThreshold) return;
+        if (!pool) {
+            // Without a pool the writer pays for the merge itself
+            base = foldLayer(*base, active);
+            active = Delta();
+            return;
+        }
+
+        {
+            std::unique_lock<std::mutex> guard(mergeMutex);
+            if (merging) {
+                // Too far ahead of the running merge: wait rather than let the delta grow unbounded
+                if (active.tombstones.size() < mergeThreshold * kMaxBacklog) return;
+                guard.unlock();
+                lock.unlock();
+                waitForMerge();
+                lock.lock();
+                guard.lock();
+                if (merging || closing || active.tombstones.size() < mergeThreshold) return;
+            }
+            merging = true;
+        }
+        freezeAndMerge();
+    }
+
+    bool hidden(int id, const Delta* older) const {
+        return (older && older->tombstones.count(id)) || active.tombstones.count(id);
+    }
+
+public:
+    explicit DeltaIndex(size_t threshold = 1024, ThreadPool* workers = nullptr)
+        : base(std::make_shared<KDTree>()), mergeThreshold(threshold), pool(workers) {}
+
+    ~DeltaIndex() {
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            closing = true;
+        }
+        waitForMerge();
+    }
+
+    // Replace everything with a fresh base built from `drivers`. The tree is
+    // built before taking the lock so readers aren't held up; a merge still
+    // running when it is installed belongs to the old generation and is
+    // discarded instead of overwriting the new base.
+    void build(std::vector<Driver> drivers) {
+        auto rebuilt = std::make_shared<KDTree>();
+        rebuilt->build(std::move(drivers), NodeLayout::VanEmdeBoas);
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        ++generation;
+        base = std::move(rebuilt);
+        frozen.reset();
+        active = Delta();
+    }
+
+    void upsert(const Driver& driver) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        active.upsert(driver);
+        maybeStartMerge(lock);
+    }
+
+    void remove(int id) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        active.erase(id);
+        maybeStartMerge(lock);
+    }
+
+    // Block until no background merge is running
+    void waitForMerge() {
+        std::unique_lock<std::mutex> guard(mergeMutex);
+        mergeDone.wait(guard, [this] { return !merging; });
+    }
+
+    size_t deltaSize() const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        return active.drivers.size() + (frozen ? frozen->drivers.size() : 0);
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        std::vector<Driver> result;
+        if (k <= 0) return result;
+        size_t limit = static_cast<size_t>(k);
+
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const Delta* older = frozen.get();
+        std::vector<std::pair<double, Driver>> merged;
+
+        // Ask the base for more until enough survive the tombstones
+        for (size_t want = limit;; want *= 2) {
+            auto fromBase = base->findNearestNeighborsWithDistance(targetLat, targetLng, static_cast<int>(want));
+            merged.clear();
+            for (auto& entry : fromBase) {
+                if (!hidden(entry.second.id, older)) merged.push_back(std::move(entry));
+            }
+            if (merged.size() >= limit || fromBase.size() < want) break;
+        }
+
+        auto scan = [&](const Delta& layer, const Delta* newer) {
+            for (size_t slot = 0; slot < layer.drivers.size(); ++slot) {
+                double dist = KDTree::squaredDistance(targetLat, targetLng, layer.lats[slot], layer.lngs[slot]);
+                if (merged.size() >= limit && dist >= merged[limit - 1].first) continue;
+                const Driver& driver = layer.drivers[slot];
+                if (!driver.available || (newer && newer->tombstones.count(driver.id))) continue;
+                merged.push_back({dist, driver});
+                std::sort(merged.begin(), merged.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+                if (merged.size() > limit) merged.pop_back();
+            }
+        };
+        if (older) scan(*older, &active);
+        scan(active, nullptr);
+
+        size_t keep = std::min(limit, merged.size());
+        result.reserve(keep);
+        for (size_t i = 0; i < keep; ++i) {
+            result.push_back(std::move(merged[i].second));
+        }
+        return result;
+    }
+
+    std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radius) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const Delta* older = frozen.get();
+        std::vector<Driver> result;
+        for (Driver& driver : base->findWithinRadius(targetLat, targetLng, radius)) {
+            if (!hidden(driver.id, older)) result.push_back(std::move(driver));
+        }
+
+        double radiusSq = radius * radius;
+        auto scan = [&](const Delta& layer, const Delta* newer) {
+            for (size_t slot = 0; slot < layer.drivers.size(); ++slot) {
+                if (KDTree::squaredDistance(targetLat, targetLng, layer.lats[slot], layer.lngs[slot]) > radiusSq) continue;
+                const Driver& driver = layer.drivers[slot];
+                if (driver.available && !(newer && newer->tombstones.count(driver.id))) result.push_back(driver);
+            }
+        };
+        if (older) scan(*older, &active);
+        scan(active, nullptr);
+        return result;
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        std::span<Neighbor> out = context.allocate<Neighbor>(limit);
+        if (limit == 0) return out;
+
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const Delta* older = frozen.get();
+        size_t filled = 0;
+        for (size_t want = limit;; want *= 2) {
+            std::span<Neighbor> fromBase = base->findNearestNeighbors(targetLat, targetLng, static_cast<int>(want), context);
+            filled = 0;
+            for (const Neighbor& hit : fromBase) {
+                if (filled < limit && !hidden(hit.id, older)) out[filled++] = hit;
+            }
+            if (filled >= limit || fromBase.size() < want) break;
+        }
+
+        auto scan = [&](const Delta& layer, const Delta* newer) {
+            for (size_t slot = 0; slot < layer.drivers.size(); ++slot) {
+                double dist = KDTree::squaredDistance(targetLat, targetLng, layer.lats[slot], layer.lngs[slot]);
+                if (filled == limit && dist >= out[limit - 1].distanceSq) continue;
+                const Driver& driver = layer.drivers[slot];
+                if (!driver.available || (newer && newer->tombstones.count(driver.id))) continue;
+                offerNeighbor(out, filled, dist, driver.id);
+            }
+        };
+        if (older) scan(*older, &active);
+        scan(active, nullptr);
+        return out.first(filled);
+    }
+
+    std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radius, QueryContext& context) const {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        const Delta* older = frozen.get();
+        std::span<Neighbor> fromBase = base->findWithinRadius(targetLat, targetLng, radius, context);
+
+        // Count the delta's share first so the result can be sized exactly
+        double radiusSq = radius * radius;
+        auto scan = [&](const Delta& layer, const Delta* newer, auto&& emit) {
+            for (size_t slot = 0; slot < layer.drivers.size(); ++slot) {
+                double dist = KDTree::squaredDistance(targetLat, targetLng, layer.lats[slot], layer.lngs[slot]);
+                if (dist > radiusSq) continue;
+                const Driver& driver = layer.drivers[slot];
+                if (driver.available && !(newer && newer->tombstones.count(driver.id))) emit(Neighbor{driver.id, dist});
+            }
+        };
+        size_t fromDelta = 0;
+        auto count = [&](const Neighbor&) { ++fromDelta; };
+        if (older) scan(*older, &active, count);
+        scan(active, nullptr, count);
+
+        std::span<Neighbor> out = context.allocate<Neighbor>(fromBase.size() + fromDelta);
+        size_t filled = 0;
+        for (const Neighbor& hit : fromBase) {
+            if (!hidden(hit.id, older)) out[filled++] = hit;
+        }
+        auto append = [&](const Neighbor& hit) { out[filled++] = hit; };
+        if (older) scan(*older, &active, append);
+        scan(active, nullptr, append);
+        return out.first(filled);
+    }
+};
+
+// Persistent KD-tree for point-in-time queries. Every write publishes a new
+// version that copies only the nodes on the paths it changed and shares the
+// rest with older versions. Nodes are bump-allocated from a chunked arena and
+// never move or die individually: a version is a refcounted root, and memory
+// comes back in bulk when compact() copies whatever the retained versions
+// still reach into a fresh arena and the old one is dropped with its last
+// reader. Writes are serialised; snapshots can be queried from any thread.
+class PersistentKDTree {
+public:
+    using Timestamp = std::chrono::system_clock::time_point;
+
+private:
+    struct PNode {
+        Driver driver;
+        PNode* left;
+        PNode* right;
+        int32_t count;
+        int32_t dead;
+        int depth;
+        bool deleted;
+        // Write that created this node; that write may still modify it in place
+        uint64_t epoch;
+    };
+
+    class Arena {
+    public:
+        static constexpr size_t kChunkNodes = 4096;
+
+        PNode* allocate(const PNode& node) {
+            if (chunks.empty() || chunks.back().size() == kChunkNodes) {
+                chunks.emplace_back();
+                chunks.back().reserve(kChunkNodes);
+            }
+            ++allocated;
+            return &chunks.back().emplace_back(node);
+        }
+
+        size_t size() const { return allocated; }
+
+    private:
+        // Chunks are reserved up front and never grow past it, so nodes stay put
+        std::vector<std::vector<PNode>> chunks;
+        size_t allocated = 0;
+    };
+
+    struct Version {
+        const PNode* root;
+        size_t size;
+        Timestamp time;
+        // Keeps every node reachable from `root` alive
+        std::shared_ptr<const Arena> arena;
+    };
+
+public:
+    // A frozen version of the tree; cheap to copy and safe to query while
+    // the tree keeps changing
+    class Snapshot {
+    public:
+        Snapshot() = default;
+
+        explicit operator bool() const { return version != nullptr; }
+        size_t size() const { return version ? version->size : 0; }
+        Timestamp time() const { return version ? version->time : Timestamp(); }
+
+        std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+            std::vector<std::pair<double, Driver>> nearest;
+            size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+            walkNearest(targetLat, targetLng, limit,
+                [&](double dist, const Driver& driver) { KDTree::offerCandidate(nearest, limit, dist, driver); },
+                [&] { return nearest.size() == limit ? nearest.back().first : kUnbounded; });
+
+            std::vector<Driver> result;
+            result.reserve(nearest.size());
+            for (auto& entry : nearest) {
+                result.push_back(entry.second);
+            }
+            return result;
+        }
+
+        std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radius) const {
+            std::vector<Driver> result;
+            walkWithin(targetLat, targetLng, radius, [&](double, const Driver& driver) { result.push_back(driver); });
+            return result;
+        }
+
+        std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+            size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+            std::span<Neighbor> out = context.allocate<Neighbor>(limit);
+            size_t filled = 0;
+            walkNearest(targetLat, targetLng, limit,
+                [&](double dist, const Driver& driver) { offerNeighbor(out, filled, dist, driver.id); },
+                [&] { return filled == limit ? out[limit - 1].distanceSq : kUnbounded; });
+            return out.first(filled);
+        }
+
+        std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radius, QueryContext& context) const {
+            size_t total = 0;
+            walkWithin(targetLat, targetLng, radius, [&](double, const Driver&) { ++total; });
+            std::span<Neighbor> out = context.allocate<Neighbor>(total);
+            size_t filled = 0;
+            walkWithin(targetLat, targetLng, radius,
+                [&](double dist, const Driver& driver) { out[filled++] = {driver.id, dist}; });
+            return out;
+        }
+
+    private:
+        friend class PersistentKDTree;
+        explicit Snapshot(std::shared_ptr<const Version> v) : version(std::move(v)) {}
+
+        std::shared_ptr<const Version> version;
+
+        static constexpr double kUnbounded = std::numeric_limits<double>::infinity();
+
+        // kNN walk shared by the result flavours: `offer(dist, driver)` records
+        // a hit and `worst()` is the distance a subtree must beat to matter
+        template <typename Offer, typename Worst>
+        void walkNearest(double targetLat, double targetLng, size_t limit, Offer&& offer, Worst&& worst) const {
+            if (!version || !version->root || limit == 0) return;
+
+            struct Frame {
+                const PNode* node;
+                double bound;
+            };
+            const double target[2] = {targetLat, targetLng};
+            InlineStack<Frame, KDTree::kInlineStackDepth> pending;
+            pending.push({version->root, 0.0});
+            while (!pending.empty()) {
+                Frame frame = pending.pop();
+                if (frame.bound >= worst()) continue;
+                for (const PNode* node = frame.node; node && node->dead != node->count;) {
+                    if (node->driver.available && !node->deleted) {
+                        offer(KDTree::squaredDistance(targetLat, targetLng, node->driver.lat, node->driver.lng), node->driver);
+                    }
+                    int axis = node->depth & 1;
+                    double diff = target[axis] - KDTree::axisValue(node->driver, axis);
+                    const PNode* nearChild = diff < 0 ? node->left : node->right;
+                    const PNode* farChild = diff < 0 ? node->right : node->left;
+                    if (farChild) pending.push({farChild, KDTree::farSideBound(target, axis, diff)});
+                    node = nearChild;
+                }
+            }
+        }
+
+        template <typename Emit>
+        void walkWithin(double targetLat, double targetLng, double radius, Emit&& emit) const {
+            if (!version || !version->root || radius < 0) return;
+
+            const double target[2] = {targetLat, targetLng};
+            const double radiusSq = radius * radius;
+            InlineStack<const PNode*, KDTree::kInlineStackDepth> pending;
+            pending.push(version->root);
+            while (!pending.empty()) {
+                const PNode* node = pending.pop();
+                if (node->dead == node->count) continue;
+                if (node->driver.available && !node->deleted) {
+                    double dist = KDTree::squaredDistance(targetLat, targetLng, node->driver.lat, node->driver.lng);
+                    if (dist <= radiusSq) emit(dist, node->driver);
+                }
+                int axis = node->depth & 1;
+                double diff = target[axis] - KDTree::axisValue(node->driver, axis);
+                bool crosses = KDTree::farSideBound(target, axis, diff) <= radiusSq;
+                if (node->left && (diff < 0 || crosses)) pending.push(node->left);
+                if (node->right && (diff >= 0 || crosses)) pending.push(node->right);
+            }
+        }
+    };
+
+private:
+    mutable std::mutex mutex;
+    std::shared_ptr<Arena> arena;
+    // Retained versions by publication time; the last one is the head
+    std::map<Timestamp, std::shared_ptr<const Version>> versions;
+    PNode* head = nullptr;
+    // Where each driver sits in the head version, to find it again on removal
+    std::unordered_map<int, std::pair<double, double>> positionById;
+    uint64_t epoch = 0;
+
+    // The node itself if the running write created it, otherwise a copy the
+    // write may modify
+    PNode* own(PNode* node) {
+        if (node->epoch == epoch) return node;
+        PNode copy = *node;
+        copy.epoch = epoch;
+        return arena->allocate(copy);
+    }
+
+    void insertDriver(const Driver& driver) {
+        PNode* fresh = arena->allocate(PNode{driver, nullptr, nullptr, 1, 0, 0, false, epoch});
+        positionById[driver.id] = {driver.lat, driver.lng};
+        if (!head) {
+            head = fresh;
+            return;
+        }
+        head = own(head);
+        for (PNode* at = head;;) {
+            ++at->count;
+            int axis = at->depth & 1;
+            PNode*& child = KDTree::axisValue(driver, axis) < KDTree::axisValue(at->driver, axis) ? at->left : at->right;
+            if (!child) {
+                fresh->depth = at->depth + 1;
+                child = fresh;
+                return;
+            }
+            child = own(child);
+            at = child;
+        }
+    }
+
+    // Leaves are cut off and inner nodes tombstoned, copying only the path
+    void removeDriver(int id) {
+        auto found = positionById.find(id);
+        if (found == positionById.end()) return;
+        const double point[2] = {found->second.first, found->second.second};
+        positionById.erase(found);
+
+        std::vector<PNode*> path;
+        for (PNode* at = head; at;) {
+            path.push_back(at);
+            if (at->driver.id == id && !at->deleted) break;
+            int axis = at->depth & 1;
+            at = point[axis] < KDTree::axisValue(at->driver, axis) ? at->left : at->right;
+        }
+
+        bool cut = !path.back()->left && !path.back()->right;
+        if (cut) path.pop_back();
+        PNode* parent = nullptr;
+        for (size_t i = 0; i < path.size(); ++i) {
+            PNode* copy = own(path[i]);
+            if (!parent) {
+                head = copy;
+            } else {
+                (parent->left == path[i] ? parent->left : parent->right) = copy;
+            }
+            copy->count -= cut;
+            copy->dead += !cut;
+            parent = copy;
+            path[i] = copy;
+        }
+        if (cut) {
+            if (!parent) {
+                head = nullptr;
+            } else {
+                // The removed leaf is whichever child still matches the search point
+                int axis = parent->depth & 1;
+                (point[axis] < KDTree::axisValue(parent->driver, axis) ? parent->left : parent->right) = nullptr;
+            }
+        } else {
+            path.back()->deleted = true;
+        }
+    }
+
+    // Called with `mutex` held once a write has finished with `head`
+    void publish(Timestamp when) {
+        // Keep history ordered even if the caller's clock steps back
+        if (!versions.empty() && when < versions.rbegin()->first) when = versions.rbegin()->first;
+        versions[when] = std::make_shared<const Version>(Version{head, positionById.size(), when, arena});
+    }
+
+    // Balanced subtree over `drivers` whose root sits at `depth`, so it can
+    // take the place of any subtree holding the same drivers
+    PNode* buildInto(Arena& target, std::vector<Driver> drivers, int depth, uint64_t createdIn) {
+        if (drivers.empty()) return nullptr;
+        std::vector<KDTree::BuildNode> shape;
+        shape.reserve(drivers.size());
+        std::vector<KDTree::BuildPoint> points = KDTree::buildPoints(drivers);
+        std::vector<KDTree::BuildRange> work{{0, drivers.size(), depth, KDTree::kNull, false}};
+        KDTree::splitRanges(points, work, shape, 0, nullptr);
+        std::vector<int32_t> counts = KDTree::subtreeCounts(shape);
+
+        // Shape nodes are in preorder, so children are created after their parent
+        std::vector<PNode*> created(shape.size());
+        for (size_t i = 0; i < shape.size(); ++i) {
+            created[i] = target.allocate(PNode{std::move(drivers[shape[i].item]), nullptr, nullptr, counts[i], 0,
+                                               shape[i].depth, false, createdIn});
+        }
+        for (size_t i = 0; i < shape.size(); ++i) {
+            if (shape[i].left != KDTree::kNull) created[i]->left = created[shape[i].left];
+            if (shape[i].right != KDTree::kNull) created[i]->right = created[shape[i].right];
+        }
+        return created[0];
+    }
+
+    // Copies the tree under `root`, dropping subtrees with nothing live. With
+    // `rebuildDead`, a subtree whose tombstone ratio crosses KDTree's
+    // compaction threshold is rebuilt from its live drivers instead. `copied`
+    // maps old nodes to new ones, so subtrees shared between versions stay
+    // shared, and a version reaching a rebuilt subtree gets the rebuilt one.
+    PNode* copyInto(Arena& target, const PNode* root, std::unordered_map<const PNode*, PNode*>& copied,
+                    bool rebuildDead) {
+        if (!root) return nullptr;
+        struct Frame {
+            const PNode* node;
+            bool expanded;
+        };
+        std::vector<Frame> pending{{root, false}};
+        while (!pending.empty()) {
+            Frame& frame = pending.back();
+            if (copied.count(frame.node)) {
+                pending.pop_back();
+                continue;
+            }
+            const PNode* node = frame.node;
+            if (node->dead == node->count ||
+                (rebuildDead && node->count >= KDTree::kMinRebuildSize &&
+                 static_cast<size_t>(node->dead) * 100 >= static_cast<size_t>(node->count) * KDTree::kCompactPercent)) {
+                pending.pop_back();
+                std::vector<Driver> live;
+                live.reserve(node->count - node->dead);
+                std::vector<const PNode*> below{node};
+                while (!below.empty()) {
+                    const PNode* at = below.back();
+                    below.pop_back();
+                    if (!at->deleted) live.push_back(at->driver);
+                    if (at->left) below.push_back(at->left);
+                    if (at->right) below.push_back(at->right);
+                }
+                copied[node] = buildInto(target, std::move(live), node->depth, 0);
+                continue;
+            }
+            if (!frame.expanded) {
+                frame.expanded = true;
+                if (node->left) pending.push_back({node->left, false});
+                if (node->right) pending.push_back({node->right, false});
+                continue;
+            }
+            pending.pop_back();
+            PNode copy = *node;
+            copy.left = node->left ? copied.at(node->left) : nullptr;
+            copy.right = node->right ? copied.at(node->right) : nullptr;
+            // Children may have shed tombstones
+            copy.count = 1 + (copy.left ? copy.left->count : 0) + (copy.right ? copy.right->count : 0);
+            copy.dead = copy.deleted + (copy.left ? copy.left->dead : 0) + (copy.right ? copy.right->dead : 0);
+            copy.epoch = 0;
+            copied[node] = target.allocate(copy);
+        }
+        return copied.at(root);
+    }
+
+public:
+    PersistentKDTree() : arena(std::make_shared<Arena>()) {}
+
+    // Start a new history from a balanced tree over `drivers`
+    void build(std::vector<Driver> drivers, Timestamp when = std::chrono::system_clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        arena = std::make_shared<Arena>();
+        versions.clear();
+        positionById.clear();
+        positionById.reserve(drivers.size());
+        ++epoch;
+        for (const Driver& driver : drivers) positionById[driver.id] = {driver.lat, driver.lng};
+        head = buildInto(*arena, std::move(drivers), 0, epoch);
+        publish(when);
+    }
+
+    // Insert or move one driver, publishing a new version
+    void upsert(const Driver& driver, Timestamp when = std::chrono::system_clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++epoch;
+        removeDriver(driver.id);
+        insertDriver(driver);
+        publish(when);
+    }
+
+    void remove(int id, Timestamp when = std::chrono::system_clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++epoch;
+        removeDriver(id);
+        publish(when);
+    }
+
+    // Apply a whole batch as one version; nodes copied for one change are
+    // reused by the rest of the batch instead of being copied again
+    void applyBatch(std::span<const Update> updates, Timestamp when = std::chrono::system_clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        ++epoch;
+        for (const Update& change : updates) {
+            removeDriver(change.driver.id);
+            if (change.kind == UpdateKind::Upsert) insertDriver(change.driver);
+        }
+        publish(when);
+    }
+
+    Snapshot current() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return versions.empty() ? Snapshot() : Snapshot(versions.rbegin()->second);
+    }
+
+    // The version that was current at `when`, or an empty snapshot before the first one
+    Snapshot at(Timestamp when) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto after = versions.upper_bound(when);
+        return after == versions.begin() ? Snapshot() : Snapshot(std::prev(after)->second);
+    }
+
+    // Stop retaining versions superseded before `when`. Snapshots already
+    // handed out stay valid; their memory is reclaimed by the next compact().
+    void releaseBefore(Timestamp when) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto inForce = versions.upper_bound(when);
+        if (inForce != versions.begin()) --inForce;
+        versions.erase(versions.begin(), inForce);
+    }
+
+    // Copy the nodes reachable from retained versions into a fresh arena,
+    // sharing subtrees as before and rebuilding the head's subtrees thick
+    // with tombstones (see copyInto). The old arena is freed in one go once no outstanding
+    // snapshot refers to it. Returns the nodes dropped.
+    size_t compact() {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto fresh = std::make_shared<Arena>();
+        std::unordered_map<const PNode*, PNode*> copied;
+        // Only the head sheds tombstones; rebuilding older versions as well
+        // would unshare them from each other. It goes first so the older
+        // versions pick up its rebuilt subtrees where they share them.
+        for (auto version = versions.rbegin(); version != versions.rend(); ++version) {
+            PNode* root = copyInto(*fresh, version->second->root, copied, version == versions.rbegin());
+            version->second = std::make_shared<const Version>(
+                Version{root, version->second->size, version->second->time, fresh});
+        }
+        head = versions.empty() ? nullptr : const_cast<PNode*>(versions.rbegin()->second->root);
+        // Rebuilt subtrees can duplicate nodes another version still shares
+        size_t dropped = arena->size() > fresh->size() ? arena->size() - fresh->size() : 0;
+        arena = std::move(fresh);
+        ++epoch;
+        return dropped;
+    }
+
+    size_t versionCount() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return versions.size();
+    }
+
+    // Nodes allocated in the current arena, live or not
+    size_t arenaNodes() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return arena->size();
+    }
+};
+
+// Latest known state of every driver, column by column. Writers only touch
+// this store; DoubleBufferedIndex turns it into trees in the background.
+class DriverStore {
+private:
+    mutable std::mutex mutex;
+    std::vector<int> ids;
+    std::vector<double> lats;
+    std::vector<double> lngs;
+    std::vector<uint32_t> nameIds;
+    std::vector<uint8_t> available;
+    std::vector<uint8_t> fleets;
+    std::unordered_map<int, size_t> slotById;
+    uint64_t revision = 0;
+
+public:
+    void upsert(const Driver& driver) {
+        checkedFleet(driver.fleet);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto [slot, inserted] = slotById.try_emplace(driver.id, ids.size());
+        if (inserted) {
+            ids.push_back(driver.id);
+            lats.push_back(driver.lat);
+            lngs.push_back(driver.lng);
+            nameIds.push_back(driver.nameId);
+            available.push_back(driver.available);
+            fleets.push_back(driver.fleet);
+        } else {
+            size_t at = slot->second;
+            lats[at] = driver.lat;
+            lngs[at] = driver.lng;
+            nameIds[at] = driver.nameId;
+            available[at] = driver.available;
+            fleets[at] = driver.fleet;
+        }
+        ++revision;
+    }
+
+    void remove(int id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = slotById.find(id);
+        if (found == slotById.end()) return;
+        size_t at = found->second;
+        size_t last = ids.size() - 1;
+        slotById.erase(found);
+        if (at != last) {
+            ids[at] = ids[last];
+            lats[at] = lats[last];
+            lngs[at] = lngs[last];
+            nameIds[at] = nameIds[last];
+            available[at] = available[last];
+            fleets[at] = fleets[last];
+            slotById[ids[at]] = at;
+        }
+        ids.pop_back();
+        lats.pop_back();
+        lngs.pop_back();
+        nameIds.pop_back();
+        available.pop_back();
+        fleets.pop_back();
+        ++revision;
+    }
+
+    // Bumped by every write, so a builder can tell whether anything changed
+    uint64_t version() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return revision;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return ids.size();
+    }
+
+    // Rows gathered back into drivers, together with the revision they reflect
+    std::vector<Driver> snapshot(uint64_t* asOf = nullptr) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<Driver> drivers;
+        drivers.reserve(ids.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            Driver& driver = drivers.emplace_back();
+            driver.id = ids[i];
+            driver.nameId = nameIds[i];
+            driver.lat = lats[i];
+            driver.lng = lngs[i];
+            driver.available = available[i] != 0;
+            driver.fleet = fleets[i];
+        }
+        if (asOf) *asOf = revision;
+        return drivers;
+    }
+};
+
+struct DoubleBufferConfig {
+    // How often the builder rebuilds the back buffer; bounds staleness
+    std::chrono::milliseconds rebuildInterval{100};
+    NodeLayout layout = NodeLayout::VanEmdeBoas;
+    // Parallelises each rebuild, trading CPU for a shorter swap cycle
+    ThreadPool* pool = nullptr;
+};
+
+struct DoubleBufferStats {
+    uint64_t swaps = 0;
+    // Snapshot plus build of the last rebuild, and how long the swap then
+    // waited for readers still on the old back buffer
+    double lastBuildMs = 0;
+    double lastDrainMs = 0;
+    // Age of the store snapshot behind the front buffer
+    double stalenessMs = 0;
+    // Store writes not yet visible to queries
+    uint64_t pendingWrites = 0;
+};
+
+// Two complete trees: queries read the front one without taking a lock, and
+// a builder thread periodically rebuilds the back one from a DriverStore and
+// swaps them. Queries see the store as of the last swap.
+class DoubleBufferedIndex {
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Buffer {
+        KDTree tree;
+        mutable std::atomic<uint32_t> readers{0};
+        Clock::time_point snapshotTime;
+        uint64_t revision = 0;
+    };
+
+    const DriverStore& store;
+    DoubleBufferConfig config;
+    std::array<Buffer, 2> buffers;
+    std::atomic<uint32_t> front{0};
+
+    std::mutex builderMutex;
+    std::condition_variable builderWake;
+    bool stopping = false;
+    std::thread builder;
+
+    mutable std::mutex statsMutex;
+    DoubleBufferStats stats;
+
+    // Pins whichever buffer is in front for the duration of one query. A
+    // reader that raced with a swap backs off and retries, so once the
+    // builder has seen the old buffer's count drop to zero nobody is left on it.
+    class ReadGuard {
+    public:
+        explicit ReadGuard(const DoubleBufferedIndex& index) {
+            while (true) {
+                uint32_t current = index.front.load();
+                const Buffer& candidate = index.buffers[current];
+                candidate.readers.fetch_add(1);
+                if (index.front.load() == current) {
+                    buffer = &candidate;
+                    return;
+                }
+                candidate.readers.fetch_sub(1);
+            }
+        }
+        ~ReadGuard() { buffer->readers.fetch_sub(1, std::memory_order_release); }
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+        const Buffer& operator*() const { return *buffer; }
+        const KDTree& tree() const { return buffer->tree; }
+
+    private:
+        const Buffer* buffer;
+    };
+
+    void builderLoop() {
+        std::unique_lock<std::mutex> lock(builderMutex);
+        while (!stopping) {
+            builderWake.wait_for(lock, config.rebuildInterval, [this] { return stopping; });
+            if (stopping) break;
+            // Only the builder writes `revision`, and it is running right here
+            if (store.version() != buffers[front.load()].revision) swapInLocked();
+        }
+    }
+
+    // Called with builderMutex held
+    void swapInLocked() {
+        uint32_t back = front.load() ^ 1u;
+        Buffer& target = buffers[back];
+
+        auto buildStart = Clock::now();
+        uint64_t revision = 0;
+        std::vector<Driver> drivers = store.snapshot(&revision);
+        auto snapshotTime = Clock::now();
+
+        // Readers that picked this buffer just before the previous swap may still be on it
+        while (target.readers.load(std::memory_order_acquire) != 0) std::this_thread::yield();
+        auto drainEnd = Clock::now();
+
+        target.tree.build(std::move(drivers), config.layout);
+        target.snapshotTime = snapshotTime;
+        target.revision = revision;
+        auto buildEnd = Clock::now();
+        front.store(back);
+
+        std::lock_guard<std::mutex> guard(statsMutex);
+        ++stats.swaps;
+        stats.lastDrainMs = std::chrono::duration<double, std::milli>(drainEnd - snapshotTime).count();
+        stats.lastBuildMs = std::chrono::duration<double, std::milli>((snapshotTime - buildStart) + (buildEnd - drainEnd)).count();
+    }
+
+public:
+    // The store must outlive the index. With `startBuilder` off, buffers only
+    // change through rebuildNow().
+    explicit DoubleBufferedIndex(const DriverStore& source, const DoubleBufferConfig& cfg = {}, bool startBuilder = true)
+        : store(source), config(cfg) {
+        for (Buffer& buffer : buffers) {
+            buffer.tree.setThreadPool(config.pool);
+            buffer.snapshotTime = Clock::now();
+        }
+        rebuildNow();
+        if (startBuilder) builder = std::thread([this] { builderLoop(); });
+    }
+
+    ~DoubleBufferedIndex() {
+        {
+            std::lock_guard<std::mutex> lock(builderMutex);
+            stopping = true;
+        }
+        builderWake.notify_all();
+        if (builder.joinable()) builder.join();
+    }
+
+    DoubleBufferedIndex(const DoubleBufferedIndex&) = delete;
+    DoubleBufferedIndex& operator=(const DoubleBufferedIndex&) = delete;
+
+    // Rebuild and swap right away on the calling thread
+    void rebuildNow() {
+        std::lock_guard<std::mutex> lock(builderMutex);
+        swapInLocked();
+    }
+
+    DoubleBufferStats metrics() const {
+        DoubleBufferStats current;
+        {
+            std::lock_guard<std::mutex> guard(statsMutex);
+            current = stats;
+        }
+        ReadGuard guard(*this);
+        current.stalenessMs = std::chrono::duration<double, std::milli>(Clock::now() - (*guard).snapshotTime).count();
+        current.pendingWrites = store.version() - (*guard).revision;
+        return current;
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighbors(targetLat, targetLng, k);
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k, FleetMask fleets) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighbors(targetLat, targetLng, k, fleets);
+    }
+
+    std::vector<std::vector<Driver>> findNearestNeighborsBatch(const std::vector<Query>& queries, int k) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighborsBatch(queries, k);
+    }
+
+    std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radius) const {
+        ReadGuard guard(*this);
+        return guard.tree().findWithinRadius(targetLat, targetLng, radius);
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighbors(targetLat, targetLng, k, context);
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, FleetMask fleets,
+                                             QueryContext& context) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighbors(targetLat, targetLng, k, fleets, context);
+    }
+
+    std::span<const std::span<Neighbor>> findNearestNeighborsBatch(const std::vector<Query>& queries, int k,
+                                                                   QueryContext& context) const {
+        ReadGuard guard(*this);
+        return guard.tree().findNearestNeighborsBatch(queries, k, context);
+    }
+
+    std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radius, QueryContext& context) const {
+        ReadGuard guard(*this);
+        return guard.tree().findWithinRadius(targetLat, targetLng, radius, context);
+    }
+
+    size_t size() const {
+        ReadGuard guard(*this);
+        return guard.tree().size();
+    }
+};
+
+struct ResultCacheConfig {
+    // Side of the square cells riders are bucketed into, in degrees
+    double cellDegrees = 0.001;
+    std::chrono::milliseconds ttl{2000};
+    // Results reaching further than this many cells from the cell centre are
+    // not cached; every update in their area would have to check them
+    int maxReachCells = 8;
+    size_t capacity = 1 << 16;
+    // An entry keeps this many times k drivers, so riders away from the
+    // cell centre can still be answered from it
+    int candidateFactor = 4;
+};
+
+struct ResultCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t expired = 0;
+    // Lookups that found an entry but were too far from its centre for the
+    // entry to prove their answer; counted as misses too
+    uint64_t unproven = 0;
+    // Entries dropped because an update landed inside their reach
+    uint64_t invalidated = 0;
+    // Entries pushed out by the CLOCK hand to make room
+    uint64_t evictions = 0;
+};
+
+// KDTree behind a short-lived cache of kNN results, for riders refreshing
+// from practically the same spot. Results are keyed by the rider's cell and
+// k. An entry holds the candidateFactor * k drivers nearest the cell centre,
+// which is every driver within some reach R of it. A rider d from the centre
+// is at least R - d from any driver left out, so if the rider's own k-th
+// nearest candidate is closer than that, the candidates re-ranked for the
+// rider's exact point are exactly what the tree would return; otherwise the
+// tree answers. Each entry is watched from every cell its circle touches. A
+// write looks at the cells of the driver's old and new position and drops
+// exactly the entries whose circle contains either, so updates elsewhere in
+// the city leave the cache alone. A full cache evicts with CLOCK, as
+// EtaCache does.
+class CachedKDTree {
+private:
+    struct Key {
+        int64_t row;
+        int64_t col;
+        int k;
+        bool operator==(const Key&) const = default;
+    };
+
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            uint64_t h = static_cast<uint64_t>(key.row) * 0x9E3779B97F4A7C15ull;
+            h ^= static_cast<uint64_t>(key.col) + 0x632BE59BD9B4E019ull + (h << 6) + (h >> 2);
+            return static_cast<size_t>(h ^ static_cast<uint64_t>(key.k) * 0xBF58476D1CE4E5B9ull);
+        }
+    };
+
+    // Drivers an entry can answer from, with their positions kept apart so
+    // ranking them for a rider stays in a few cache lines
+    struct Candidates {
+        std::vector<Driver> drivers;
+        std::vector<std::pair<double, double>> positions;
+    };
+
+    struct Entry {
+        // Every available driver within the reach of the cell centre, and
+        // nothing further out
+        Candidates candidates;
+        // Cell centre and the squared radius of the circle kept round it
+        double lat;
+        double lng;
+        double reachSq;
+        std::chrono::steady_clock::time_point stored;
+        uint64_t serial;
+        // Position in `ring`, and whether a hit came since the hand passed
+        size_t slot;
+        bool referenced;
+    };
+
+    // Watch lists name entries by key and serial, so a list never needs
+    // editing when an entry goes; stale references are dropped as met
+    struct Watch {
+        Key key;
+        uint64_t serial;
+    };
+
+    static constexpr size_t kWatchesPerEntry = 16;
+
+    ResultCacheConfig config;
+    int64_t columns;
+    mutable std::shared_mutex treeMutex;
+    KDTree tree;
+
+    mutable std::mutex cacheMutex;
+    std::unordered_map<Key, Entry, KeyHash> entries;
+    // CLOCK ring of keys; a slot whose entry has since gone is free to reuse
+    std::vector<Key> ring;
+    size_t hand = 0;
+    std::unordered_map<uint64_t, std::vector<Watch>> watchers;
+    uint64_t nextSerial = 0;
+    size_t watchCount = 0;
+    // Sweep once watchCount passes this; at least twice what the last sweep
+    // kept, so live watches alone never trigger back-to-back sweeps
+    size_t sweepAt = 0;
+    // Bumped by every write, under cacheMutex; a result computed before the
+    // bump is not cached
+    uint64_t writeEpoch = 0;
+    ResultCacheStats counters;
+
+    int64_t rowOf(double lat) const {
+        return static_cast<int64_t>(std::floor((lat + 90.0) / config.cellDegrees));
+    }
+
+    // Columns wrap round the antimeridian
+    int64_t colOf(double lng) const {
+        int64_t col = static_cast<int64_t>(std::floor((lng + 180.0) / config.cellDegrees));
+        return ((col % columns) + columns) % columns;
+    }
+
+    static uint64_t cellId(int64_t row, int64_t col) {
+        return (static_cast<uint64_t>(row) << 32) ^ static_cast<uint64_t>(col);
+    }
+
+    std::pair<double, double> cellCentre(int64_t row, int64_t col) const {
+        return {(row + 0.5) * config.cellDegrees - 90.0, (col + 0.5) * config.cellDegrees - 180.0};
+    }
+
+    // Rank the candidates for the target into `ranked`, the k nearest first
+    // as (squared distance, index), and tell whether those k are provably
+    // what the tree would return: not when a driver beyond the reach of the
+    // centre could be among them. The margin covers rounding in the roots.
+    static bool rankProven(const Candidates& candidates, double centreLat, double centreLng, double reachSq,
+                           double lat, double lng, int k, std::span<std::pair<double, size_t>> ranked) {
+        const auto& positions = candidates.positions;
+        if (k <= 0 || positions.size() < static_cast<size_t>(k) || ranked.size() < positions.size()) return false;
+        ranked = ranked.first(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+            ranked[i] = {KDTree::squaredDistance(lat, lng, positions[i].first, positions[i].second), i};
+        }
+        std::partial_sort(ranked.begin(), ranked.begin() + k, ranked.end());
+        double offset = std::sqrt(KDTree::squaredDistance(lat, lng, centreLat, centreLng));
+        return (std::sqrt(ranked[k - 1].first) + offset) * (1 + 1e-9) < std::sqrt(reachSq);
+    }
+
+    // Ring slot for a new entry: a free one, else the first the hand finds
+    // unreferenced since its last pass; caller holds cacheMutex
+    size_t claimSlot(const Key& key) {
+        if (ring.size() < config.capacity) {
+            ring.push_back(key);
+            return ring.size() - 1;
+        }
+        while (true) {
+            size_t index = hand;
+            hand = (hand + 1) % ring.size();
+            auto held = entries.find(ring[index]);
+            if (held != entries.end() && held->second.slot == index) {
+                if (held->second.referenced) {
+                    held->second.referenced = false;
+                    continue;
+                }
+                entries.erase(held);
+                ++counters.evictions;
+            }
+            ring[index] = key;
+            return index;
+        }
+    }
+
+    // Drop every entry whose circle holds the point; caller holds cacheMutex
+    void invalidateAround(double lat, double lng) {
+        auto found = watchers.find(cellId(rowOf(lat), colOf(lng)));
+        if (found == watchers.end()) return;
+        std::vector<Watch>& list = found->second;
+        size_t kept = 0;
+        for (const Watch& watch : list) {
+            auto entry = entries.find(watch.key);
+            if (entry == entries.end() || entry->second.serial != watch.serial) continue;
+            if (KDTree::squaredDistance(entry->second.lat, entry->second.lng, lat, lng) <= entry->second.reachSq) {
+                entries.erase(entry);
+                ++counters.invalidated;
+                continue;
+            }
+            list[kept++] = watch;
+        }
+        watchCount -= list.size() - kept;
+        list.resize(kept);
+        if (list.empty()) watchers.erase(found);
+    }
+
+    size_t sweepThreshold() const {
+        return std::max(kWatchesPerEntry * config.capacity, sweepAt);
+    }
+
+    // Watches outlive entries that expire or are replaced; once they pile up,
+    // drop every stale one in a single pass
+    void sweepWatchers() {
+        watchCount = 0;
+        for (auto it = watchers.begin(); it != watchers.end();) {
+            std::vector<Watch>& list = it->second;
+            std::erase_if(list, [&](const Watch& watch) {
+                auto entry = entries.find(watch.key);
+                return entry == entries.end() || entry->second.serial != watch.serial;
+            });
+            watchCount += list.size();
+            it = list.empty() ? watchers.erase(it) : std::next(it);
+        }
+        sweepAt = 2 * watchCount;
+    }
+
+    // Caller holds cacheMutex
+    void store(const Key& key, double lat, double lng, Candidates candidates, double reachSq) {
+        if (config.capacity == 0) return;
+        double reach = std::sqrt(reachSq);
+        auto found = entries.find(key);
+        size_t slot = found != entries.end() ? found->second.slot : claimSlot(key);
+        if (watchCount > sweepThreshold()) sweepWatchers();
+
+        uint64_t serial = nextSerial++;
+        Entry& entry = entries[key];
+        entry = {std::move(candidates), lat, lng, reachSq, std::chrono::steady_clock::now(), serial, slot, false};
+        int64_t rowFirst = rowOf(lat - reach);
+        int64_t rowLast = rowOf(lat + reach);
+        int64_t colFirst = static_cast<int64_t>(std::floor((lng - reach + 180.0) / config.cellDegrees));
+        int64_t colLast = static_cast<int64_t>(std::floor((lng + reach + 180.0) / config.cellDegrees));
+        for (int64_t row = rowFirst; row <= rowLast; ++row) {
+            for (int64_t col = colFirst; col <= colLast; ++col) {
+                watchers[cellId(row, ((col % columns) + columns) % columns)].push_back({key, serial});
+                ++watchCount;
+            }
+        }
+    }
+
+    // Apply a write to the tree and drop the results it could change: those
+    // holding a changed driver's old or new position
+    template <typename Change>
+    void write(std::span<const Update> changes, Change&& change) {
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::vector<std::pair<double, double>> touched;
+        for (const Update& update : changes) {
+            if (const Driver* old = tree.driverById(update.driver.id)) touched.push_back({old->lat, old->lng});
+            if (update.kind == UpdateKind::Upsert) touched.push_back({update.driver.lat, update.driver.lng});
+        }
+        change();
+
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        ++writeEpoch;
+        for (const auto& [lat, lng] : touched) invalidateAround(lat, lng);
+    }
+
+    // One kNN through the cache. `proven(drivers)` copies out the first k of
+    // a proven ranking left in `ranked`, under the cache lock; `fromTree()`
+    // asks the tree instead, under its shared lock. `ranked` needs a slot
+    // per candidate, candidateFactor * k.
+    template <typename Proven, typename FromTree>
+    void lookup(double targetLat, double targetLng, int k, std::span<std::pair<double, size_t>> ranked,
+                Proven&& proven, FromTree&& fromTree) {
+        Key key{rowOf(targetLat), colOf(targetLng), k};
+        bool held = false;
+        {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            auto found = entries.find(key);
+            if (found != entries.end()) {
+                if (std::chrono::steady_clock::now() - found->second.stored <= config.ttl) {
+                    Entry& entry = found->second;
+                    if (rankProven(entry.candidates, entry.lat, entry.lng, entry.reachSq,
+                                   targetLat, targetLng, k, ranked)) {
+                        ++counters.hits;
+                        entry.referenced = true;
+                        proven(entry.candidates.drivers);
+                        return;
+                    }
+                    ++counters.unproven;
+                    held = true;
+                } else {
+                    ++counters.expired;
+                    entries.erase(found);
+                }
+            }
+            ++counters.misses;
+        }
+
+        // Gather the cell's candidates from its centre, unless a live entry
+        // already holds them, and answer the rider from them when they can;
+        // too few drivers to fill them (when every new one matters) or a
+        // reach too far to be worth watching leaves the cell uncached
+        auto [centreLat, centreLng] = cellCentre(key.row, key.col);
+        size_t wanted = held || k <= 0 ? 0 : static_cast<size_t>(config.candidateFactor) * k;
+        std::vector<Neighbor> near(wanted);
+        Candidates candidates;
+        double reachSq = 0.0;
+        uint64_t epoch;
+        {
+            std::shared_lock<std::shared_mutex> lock(treeMutex);
+            if (wanted > 0 && tree.findNearestNeighbors(centreLat, centreLng, std::span<Neighbor>(near)) == wanted) {
+                reachSq = near.back().distanceSq;
+                candidates.drivers.reserve(wanted);
+                candidates.positions.reserve(wanted);
+                for (const Neighbor& neighbor : near) {
+                    const Driver& driver = *tree.driverById(neighbor.id);
+                    candidates.drivers.push_back(driver);
+                    candidates.positions.push_back({driver.lat, driver.lng});
+                }
+            }
+            if (rankProven(candidates, centreLat, centreLng, reachSq, targetLat, targetLng, k, ranked)) {
+                proven(candidates.drivers);
+            } else {
+                fromTree();
+            }
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            epoch = writeEpoch;
+        }
+
+        if (!candidates.drivers.empty() && std::ceil(std::sqrt(reachSq) / config.cellDegrees) <= config.maxReachCells) {
+            std::lock_guard<std::mutex> guard(cacheMutex);
+            if (epoch == writeEpoch) store(key, centreLat, centreLng, std::move(candidates), reachSq);
+        }
+    }
+
+public:
+    explicit CachedKDTree(ResultCacheConfig cfg = {})
+        : config(cfg), columns(static_cast<int64_t>(std::ceil(360.0 / cfg.cellDegrees))) {}
+
+    void build(std::vector<Driver> drivers, NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.build(std::move(drivers), layout);
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        ++writeEpoch;
+        entries.clear();
+        ring.clear();
+        hand = 0;
+        watchers.clear();
+        watchCount = 0;
+        sweepAt = 0;
+    }
+
+    void insert(const Driver& driver) {
+        Update change{driver, UpdateKind::Upsert};
+        write(std::span<const Update>(&change, 1), [&] { tree.insert(driver); });
+    }
+
+    void update(const Driver& driver) {
+        insert(driver);
+    }
+
+    void remove(const Driver& driver) {
+        Update change{driver, UpdateKind::Remove};
+        write(std::span<const Update>(&change, 1), [&] { tree.remove(driver); });
+    }
+
+    void applyBatch(std::span<const Update> updates) {
+        write(updates, [&] { tree.applyBatch(updates); });
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) {
+        std::vector<Driver> result;
+        std::vector<std::pair<double, size_t>> ranked(k > 0 ? static_cast<size_t>(config.candidateFactor) * k : 0);
+        lookup(targetLat, targetLng, k, ranked,
+            [&](const std::vector<Driver>& drivers) {
+                for (int i = 0; i < k; ++i) result.push_back(drivers[ranked[i].second]);
+            },
+            [&] { result = tree.findNearestNeighbors(targetLat, targetLng, k); });
+        return result;
+    }
+
+    // Context variant; a hit allocates nothing outside `context`, while a
+    // miss still allocates the entry it stores
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) {
+        size_t limit = k > 0 ? static_cast<size_t>(k) : 0;
+        auto ranked = context.allocate<std::pair<double, size_t>>(limit * config.candidateFactor);
+        std::span<Neighbor> result;
+        lookup(targetLat, targetLng, k, ranked,
+            [&](const std::vector<Driver>& drivers) {
+                result = context.allocate<Neighbor>(limit);
+                for (size_t i = 0; i < limit; ++i) result[i] = {drivers[ranked[i].second].id, ranked[i].first};
+            },
+            [&] { result = tree.findNearestNeighbors(targetLat, targetLng, k, context); });
+        return result;
+    }
+
+    ResultCacheStats stats() const {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        return counters;
+    }
+
+    size_t cachedResults() const {
+        std::lock_guard<std::mutex> guard(cacheMutex);
+        return entries.size();
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.size();
+    }
+};
+
+// KDTree plus first-in-first-out queues for zones such as airport lots,
+// where dispatch goes by arrival rather than distance. Writes keep the
+// queues in step: an available driver placed inside a zone joins the back
+// of its queue and keeps their place while moving within the zone; leaving
+// it, going unavailable or being removed drops them out. A driver taken off
+// by dequeue() or cancel() stays off until they have left the zone and come
+// back, so their next ping from the lot doesn't queue them again. Riders inside a
+// zone are offered its queue heads instead of the nearest drivers. Queue
+// operations take their own lock and never walk the tree, so they don't
+// hold up spatial queries.
+class ZoneQueueIndex {
+private:
+    struct Placement {
+        size_t zone;
+        std::list<Driver>::iterator slot;
+    };
+
+    std::vector<Geofence> zones;
+    mutable std::shared_mutex treeMutex;
+    KDTree tree;
+
+    mutable std::mutex queueMutex;
+    std::vector<std::list<Driver>> queues;
+    std::unordered_map<int, Placement> placements;
+    // Zone each dispatched or cancelled driver was taken out of
+    std::unordered_map<int, size_t> heldOut;
+
+    // Caller holds queueMutex
+    void enqueueOrRefresh(const Driver& driver) {
+        int at = zoneAt(driver.lat, driver.lng);
+        auto held = heldOut.find(driver.id);
+        if (held != heldOut.end()) {
+            if (held->second == static_cast<size_t>(at)) return;
+            heldOut.erase(held);
+        }
+        int zone = driver.available ? at : -1;
+        auto found = placements.find(driver.id);
+        if (found != placements.end()) {
+            if (found->second.zone == static_cast<size_t>(zone)) {
+                *found->second.slot = driver;
+                return;
+            }
+            queues[found->second.zone].erase(found->second.slot);
+            placements.erase(found);
+        }
+        if (zone < 0) return;
+        std::list<Driver>& queue = queues[zone];
+        queue.push_back(driver);
+        placements.emplace(driver.id, Placement{static_cast<size_t>(zone), std::prev(queue.end())});
+    }
+
+    // Caller holds queueMutex
+    bool dropFromQueue(int id) {
+        auto found = placements.find(id);
+        if (found == placements.end()) return false;
+        queues[found->second.zone].erase(found->second.slot);
+        placements.erase(found);
+        return true;
+    }
+
+public:
+    explicit ZoneQueueIndex(std::vector<Geofence> queueZones)
+        : zones(std::move(queueZones)), queues(zones.size()) {}
+
+    // Zone holding the point, or -1; the first listed wins where zones overlap
+    int zoneAt(double lat, double lng) const {
+        for (size_t i = 0; i < zones.size(); ++i) {
+            if (zones[i].contains(lat, lng)) return static_cast<int>(i);
+        }
+        return -1;
+    }
+
+    // Drivers already inside a zone are queued in the order given
+    void build(std::vector<Driver> drivers, NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        std::vector<Driver> queued;
+        for (const Driver& driver : drivers) {
+            if (driver.available && zoneAt(driver.lat, driver.lng) >= 0) queued.push_back(driver);
+        }
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.build(std::move(drivers), layout);
+        std::lock_guard<std::mutex> guard(queueMutex);
+        for (auto& queue : queues) queue.clear();
+        placements.clear();
+        heldOut.clear();
+        for (const Driver& driver : queued) enqueueOrRefresh(driver);
+    }
+
+    void insert(const Driver& driver) {
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.insert(driver);
+        std::lock_guard<std::mutex> guard(queueMutex);
+        enqueueOrRefresh(driver);
+    }
+
+    void update(const Driver& driver) {
+        insert(driver);
+    }
+
+    void remove(const Driver& driver) {
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.remove(driver);
+        std::lock_guard<std::mutex> guard(queueMutex);
+        dropFromQueue(driver.id);
+        heldOut.erase(driver.id);
+    }
+
+    // KDTree::applyBatch, with the queues following each change in batch
+    // order, so drivers arriving in one window queue in the order they arrived
+    void applyBatch(std::span<const Update> updates) {
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.applyBatch(updates);
+        std::lock_guard<std::mutex> guard(queueMutex);
+        for (const Update& change : updates) {
+            if (change.kind == UpdateKind::Upsert) {
+                enqueueOrRefresh(change.driver);
+            } else {
+                dropFromQueue(change.driver.id);
+                heldOut.erase(change.driver.id);
+            }
+        }
+    }
+
+    // Hand out the driver at the head of a zone's queue. They stay in the
+    // tree; the update marking them unavailable follows from the caller.
+    std::optional<Driver> dequeue(size_t zone) {
+        std::lock_guard<std::mutex> guard(queueMutex);
+        if (zone >= queues.size() || queues[zone].empty()) return std::nullopt;
+        Driver head = queues[zone].front();
+        placements.erase(head.id);
+        heldOut[head.id] = zone;
+        queues[zone].pop_front();
+        return head;
+    }
+
+    // Take a driver out of whatever queue holds them, e.g. when they leave
+    // the lot for a trip booked elsewhere. Returns false if none did.
+    bool cancel(int driverId) {
+        std::lock_guard<std::mutex> guard(queueMutex);
+        auto found = placements.find(driverId);
+        if (found == placements.end()) return false;
+        heldOut[driverId] = found->second.zone;
+        return dropFromQueue(driverId);
+    }
+
+    // Up to `limit` drivers from the head of a zone's queue, first in first
+    std::vector<Driver> queued(size_t zone, size_t limit) const {
+        std::vector<Driver> result;
+        std::lock_guard<std::mutex> guard(queueMutex);
+        if (zone >= queues.size()) return result;
+        for (auto it = queues[zone].begin(); it != queues[zone].end() && result.size() < limit; ++it) {
+            result.push_back(*it);
+        }
+        return result;
+    }
+
+    size_t queueLength(size_t zone) const {
+        std::lock_guard<std::mutex> guard(queueMutex);
+        return zone < queues.size() ? queues[zone].size() : 0;
+    }
+
+    // A rider inside a zone with drivers queued gets up to k of them in
+    // queue order; anyone else, or a rider at an empty lot, gets the k nearest
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        int zone = zoneAt(targetLat, targetLng);
+        if (zone >= 0 && k > 0) {
+            std::vector<Driver> heads = queued(static_cast<size_t>(zone), static_cast<size_t>(k));
+            if (!heads.empty()) return heads;
+        }
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.findNearestNeighbors(targetLat, targetLng, k);
+    }
+
+    // Context variant; queue heads keep queue order, each with its squared
+    // distance from the rider
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        int zone = zoneAt(targetLat, targetLng);
+        if (zone >= 0 && k > 0) {
+            std::span<Neighbor> heads = context.allocate<Neighbor>(static_cast<size_t>(k));
+            size_t filled = 0;
+            {
+                std::lock_guard<std::mutex> guard(queueMutex);
+                const auto& queue = queues[static_cast<size_t>(zone)];
+                for (auto it = queue.begin(); it != queue.end() && filled < heads.size(); ++it) {
+                    heads[filled++] = {it->id, KDTree::squaredDistance(targetLat, targetLng, it->lat, it->lng)};
+                }
+            }
+            if (filled > 0) return heads.first(filled);
+        }
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.findNearestNeighbors(targetLat, targetLng, k, context);
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.size();
+    }
+};
+
+struct HeatmapConfig {
+    // Cell side at the finest level, in degrees; each coarser level doubles it
+    double finestCellDegrees = 0.0025;
+    int levels = 4;
+};
+
+// Available drivers in one cell: rows count up from the south pole and
+// columns east from the antimeridian, in cells of the level's size
+struct HeatCell {
+    uint32_t row;
+    uint32_t col;
+    uint32_t count;
+};
+
+// Every occupied cell at every level, as of one moment
+struct HeatmapSnapshot {
+    std::chrono::steady_clock::time_point taken;
+    std::vector<double> cellDegrees;
+    std::vector<std::vector<HeatCell>> levels;
+};
+
+// KDTree that also keeps a count of available drivers per grid cell at
+// several resolutions, for surge pricing. Levels nest, a coarse cell being
+// exactly four finer ones, so a write works out its finest cells once and
+// shifts for the rest; a move that stays in one cell at some level stays in
+// one cell at every coarser level too, and stops there. Only occupied cells
+// are stored, so exporting a snapshot costs the number of cells, never the
+// number of drivers.
+class HeatmapIndex {
+private:
+    HeatmapConfig config;
+    uint32_t columns;
+    mutable std::shared_mutex treeMutex;
+    KDTree tree;
+
+    mutable std::mutex countMutex;
+    std::vector<std::unordered_map<uint64_t, uint32_t>> counts;
+
+    // (row, col) at the finest level
+    using Cell = std::pair<uint32_t, uint32_t>;
+
+    Cell finestCell(double lat, double lng) const {
+        auto row = static_cast<uint32_t>((std::clamp(lat, -90.0, 90.0) + 90.0) / config.finestCellDegrees);
+        auto col = static_cast<int64_t>(std::floor((lng + 180.0) / config.finestCellDegrees));
+        col = ((col % columns) + columns) % columns;
+        return {row, static_cast<uint32_t>(col)};
+    }
+
+    // Where a driver counts, if anywhere
+    std::optional<Cell> countedCell(const Driver& driver) const {
+        if (!driver.available) return std::nullopt;
+        return finestCell(driver.lat, driver.lng);
+    }
+
+    static uint64_t cellKey(uint32_t row, uint32_t col) {
+        return (static_cast<uint64_t>(row) << 32) | col;
+    }
+
+    // Move one driver's contribution between cells; caller holds countMutex
+    void shift(std::optional<Cell> from, std::optional<Cell> to) {
+        for (int level = 0; level < config.levels; ++level) {
+            uint64_t fromKey = from ? cellKey(from->first >> level, from->second >> level) : 0;
+            uint64_t toKey = to ? cellKey(to->first >> level, to->second >> level) : 0;
+            if (from && to && fromKey == toKey) return;
+            if (from) {
+                auto found = counts[level].find(fromKey);
+                if (--found->second == 0) counts[level].erase(found);
+            }
+            if (to) ++counts[level][toKey];
+        }
+    }
+
+    // Apply a write to the tree and the counts. Only the last change per
+    // driver matters, as with KDTree::applyBatch; sorting the batch by id
+    // finds it without a hash map per write.
+    template <typename Change>
+    void write(std::span<const Update> changes, Change&& change) {
+        std::vector<std::pair<int, size_t>> order(changes.size());
+        for (size_t i = 0; i < changes.size(); ++i) order[i] = {changes[i].driver.id, i};
+        std::sort(order.begin(), order.end());
+
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::vector<std::pair<std::optional<Cell>, std::optional<Cell>>> moves;
+        moves.reserve(order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (i + 1 < order.size() && order[i + 1].first == order[i].first) continue;
+            const Update& last = changes[order[i].second];
+            const Driver* old = tree.driverById(last.driver.id);
+            std::optional<Cell> from = old ? countedCell(*old) : std::nullopt;
+            std::optional<Cell> to = last.kind == UpdateKind::Upsert ? countedCell(last.driver) : std::nullopt;
+            if (from != to) moves.push_back({from, to});
+        }
+        change();
+
+        std::lock_guard<std::mutex> guard(countMutex);
+        for (const auto& [from, to] : moves) shift(from, to);
+    }
+
+public:
+    explicit HeatmapIndex(HeatmapConfig cfg = {})
+        : config(cfg),
+          columns(static_cast<uint32_t>(std::ceil(360.0 / cfg.finestCellDegrees))),
+          counts(static_cast<size_t>(std::max(1, cfg.levels))) {
+        config.levels = std::max(1, config.levels);
+    }
+
+    void build(std::vector<Driver> drivers, NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        std::vector<std::unordered_map<uint64_t, uint32_t>> fresh(counts.size());
+        for (const Driver& driver : drivers) {
+            auto cell = countedCell(driver);
+            if (!cell) continue;
+            for (int level = 0; level < config.levels; ++level) {
+                ++fresh[level][cellKey(cell->first >> level, cell->second >> level)];
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        tree.build(std::move(drivers), layout);
+        std::lock_guard<std::mutex> guard(countMutex);
+        counts = std::move(fresh);
+    }
+
+    void insert(const Driver& driver) {
+        Update change{driver, UpdateKind::Upsert};
+        write(std::span<const Update>(&change, 1), [&] { tree.insert(driver); });
+    }
+
+    // Covers availability changes too: an unavailable driver counts nowhere
+    void update(const Driver& driver) {
+        insert(driver);
+    }
+
+    void remove(const Driver& driver) {
+        Update change{driver, UpdateKind::Remove};
+        write(std::span<const Update>(&change, 1), [&] { tree.remove(driver); });
+    }
+
+    void applyBatch(std::span<const Update> updates) {
+        write(updates, [&] { tree.applyBatch(updates); });
+    }
+
+    // Available drivers in the cell at `level` holding the point
+    uint32_t count(int level, double lat, double lng) const {
+        if (level < 0 || level >= config.levels) return 0;
+        Cell cell = finestCell(lat, lng);
+        std::lock_guard<std::mutex> guard(countMutex);
+        auto found = counts[level].find(cellKey(cell.first >> level, cell.second >> level));
+        return found == counts[level].end() ? 0 : found->second;
+    }
+
+    double cellDegrees(int level) const {
+        return std::ldexp(config.finestCellDegrees, level);
+    }
+
+    // South-west corner of a cell, for drawing or joining a snapshot
+    std::pair<double, double> cellCorner(int level, uint32_t row, uint32_t col) const {
+        double side = cellDegrees(level);
+        return {row * side - 90.0, col * side - 180.0};
+    }
+
+    HeatmapSnapshot snapshot() const {
+        HeatmapSnapshot result;
+        result.levels.resize(counts.size());
+        for (int level = 0; level < config.levels; ++level) result.cellDegrees.push_back(cellDegrees(level));
+        std::lock_guard<std::mutex> guard(countMutex);
+        result.taken = std::chrono::steady_clock::now();
+        for (size_t level = 0; level < counts.size(); ++level) {
+            std::vector<HeatCell>& cells = result.levels[level];
+            cells.reserve(counts[level].size());
+            for (const auto& [key, count] : counts[level]) {
+                cells.push_back({static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key), count});
+            }
+        }
+        return result;
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.findNearestNeighbors(targetLat, targetLng, k);
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.findNearestNeighbors(targetLat, targetLng, k, context);
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return tree.size();
+    }
+};
+
+// Metres east (x) and north (y) of a projection origin
+struct LocalPoint {
+    float x;
+    float y;
+};
+
+// Equirectangular projection around an origin on a spherical Earth, the same
+// model as haversine. Degree differences overstate east-west distance by
+// 1/cos(lat), about 2x in Oslo but nothing in Singapore; projected, both are
+// metres. Within a metro (tens of km of the origin) the error against the
+// great-circle distance stays well under 0.1%. Longitude offsets wrap, so a
+// metro straddling the antimeridian is one contiguous patch; near the poles
+// the frame degenerates and ShardGeometry::Ecef should be used instead.
+struct LocalProjection {
+    static constexpr double kEarthRadiusMetres = 6371008.8;
+    static constexpr double kMetresPerDegree = kEarthRadiusMetres * std::numbers::pi / 180.0;
+
+    double originLat = 0.0;
+    double originLng = 0.0;
+    double metresPerDegreeLng = kMetresPerDegree;
+
+    static LocalProjection centeredOn(double lat, double lng) {
+        LocalProjection projection;
+        projection.originLat = lat;
+        projection.originLng = lng;
+        projection.metresPerDegreeLng = kMetresPerDegree * std::cos(lat * std::numbers::pi / 180.0);
+        return projection;
+    }
+
+    // Centred on the drivers' bounding box, so a frame refitted at every
+    // rebuild follows the fleet as it drifts. The longitude range is also
+    // measured on [0, 360) and the narrower reading wins, so a fleet around
+    // Fiji is centred near 180 rather than on Greenwich.
+    static LocalProjection fitting(const std::vector<Driver>& drivers) {
+        if (drivers.empty()) return centeredOn(0.0, 0.0);
+        double minLat = drivers[0].lat, maxLat = minLat;
+        double minLng = std::numeric_limits<double>::infinity(), maxLng = -minLng;
+        double minShifted = minLng, maxShifted = maxLng;
+        for (const Driver& driver : drivers) {
+            minLat = std::min(minLat, driver.lat);
+            maxLat = std::max(maxLat, driver.lat);
+            minLng = std::min(minLng, driver.lng);
+            maxLng = std::max(maxLng, driver.lng);
+            double shifted = driver.lng < 0 ? driver.lng + 360.0 : driver.lng;
+            minShifted = std::min(minShifted, shifted);
+            maxShifted = std::max(maxShifted, shifted);
+        }
+        double centreLng = maxShifted - minShifted < maxLng - minLng
+            ? std::remainder((minShifted + maxShifted) / 2, 360.0)
+            : (minLng + maxLng) / 2;
+        return centeredOn((minLat + maxLat) / 2, centreLng);
+    }
+
+    // Offsets are taken in double before narrowing, so float32 keeps
+    // millimetre resolution across a metro
+    LocalPoint toLocal(double lat, double lng) const {
+        return {static_cast<float>(std::remainder(lng - originLng, 360.0) * metresPerDegreeLng),
+                static_cast<float>((lat - originLat) * kMetresPerDegree)};
+    }
+};
+
+// How a ProjectedShard places drivers. Local is the shard's own flat frame in
+// metres: the fast default, exact enough within a metro. Ecef places them on
+// the sphere as 3D vectors in metres, rotated so the origin sits at (0, 0, 0)
+// with x east, y north and z up. Straight-line (chord) distance there orders
+// drivers exactly as great-circle distance does at any latitude and range,
+// for one more coordinate per distance. Splits still only use x and y: the
+// chord is never shorter than the gap across such a plane, so pruning stays
+// exact, and z barely varies within a metro.
+enum class ShardGeometry {
+    Local,
+    Ecef
+};
+
+// Static index over one metro in its own projected frame. Nodes hold float32
+// metres rather than a Driver in degrees, 24 bytes instead of a cache line,
+// and all distances and pruning are Euclidean metres wherever the metro is.
+// Queries take lat/lng and radii in metres; results are the original drivers,
+// or Neighbors with squared metres (squared chord metres under Ecef). build()
+// refits the frame to the drivers, so a shard rebuilt periodically (e.g. by a
+// double buffer) re-centres itself.
+class ProjectedShard {
+private:
+    // Local leaves the third coordinate at zero, so both geometries share
+    // one traversal
+    struct Node {
+        float coord[3];
+        int32_t left;
+        int32_t right;
+        uint8_t axis;
+        bool available;
+    };
+
+    struct ShardPoint {
+        double coord[3];
+        size_t item;
+    };
+
+    using FramePoint = std::array<float, 3>;
+
+    static constexpr int32_t kNull = KDTree::kNull;
+
+    LocalProjection frame;
+    ShardGeometry geometry = ShardGeometry::Local;
+    double sinOriginLat = 0.0;
+    double cosOriginLat = 1.0;
+    // drivers[i] is the driver stored at nodes[i]
+    std::vector<Node> nodes;
+    std::vector<Driver> drivers;
+    std::unordered_map<int, int32_t> slotById;
+    int32_t root = kNull;
+
+    FramePoint toFrame(double lat, double lng) const {
+        if (geometry == ShardGeometry::Local) {
+            LocalPoint local = frame.toLocal(lat, lng);
+            return {local.x, local.y, 0.0f};
+        }
+        // Unit vector dotted with the east, north and up axes at the origin
+        constexpr double toRadians = std::numbers::pi / 180.0;
+        constexpr double radius = LocalProjection::kEarthRadiusMetres;
+        double sinLat = std::sin(lat * toRadians);
+        double cosLat = std::cos(lat * toRadians);
+        double dLng = (lng - frame.originLng) * toRadians;
+        double cosDLng = std::cos(dLng);
+        double up = cosLat * cosOriginLat * cosDLng + sinLat * sinOriginLat;
+        return {static_cast<float>(radius * cosLat * std::sin(dLng)),
+                static_cast<float>(radius * (sinLat * cosOriginLat - cosLat * sinOriginLat * cosDLng)),
+                static_cast<float>(radius * (up - 1.0))};
+    }
+
+    // A great-circle radius as a distance in the frame
+    double frameRadius(double radiusMetres) const {
+        if (geometry == ShardGeometry::Local || radiusMetres < 0) return radiusMetres;
+        constexpr double radius = LocalProjection::kEarthRadiusMetres;
+        return 2 * radius * std::sin(std::min(radiusMetres / radius, std::numbers::pi) / 2);
+    }
+
+    static float frameDistance(const float* a, const float* b) {
+        float dx = a[0] - b[0];
+        float dy = a[1] - b[1];
+        float dz = a[2] - b[2];
+        return dx * dx + dy * dy + dz * dz;
+    }
+
+    // kNN over node slots: fills out[0, result) closest first, with node
+    // indexes in place of driver ids
+    size_t nearestSlots(const FramePoint& point, std::span<Neighbor> out) const {
+        size_t filled = 0;
+        if (root == kNull || out.empty()) return 0;
+
+        struct Frame {
+            int32_t node;
+            float bound;
+        };
+        InlineStack<Frame, KDTree::kInlineStackDepth> pending;
+        pending.push({root, 0.0f});
+        while (!pending.empty()) {
+            Frame frame = pending.pop();
+            if (filled == out.size() && frame.bound >= out[filled - 1].distanceSq) continue;
+
+            for (int32_t index = frame.node; index != kNull;) {
+                const Node& node = nodes[index];
+                if (node.available) offerNeighbor(out, filled, frameDistance(point.data(), node.coord), index);
+                float diff = point[node.axis] - node.coord[node.axis];
+                int32_t nearChild = diff < 0 ? node.left : node.right;
+                int32_t farChild = diff < 0 ? node.right : node.left;
+                if (farChild != kNull) pending.push({farChild, diff * diff});
+                index = nearChild;
+            }
+        }
+        return filled;
+    }
+
+    // Call emit(slot, squared frame distance) for every available driver
+    // within `radius`, measured in the frame
+    template <typename Emit>
+    void walkWithin(const FramePoint& point, double radius, Emit&& emit) const {
+        if (root == kNull || radius < 0) return;
+
+        const float radiusSq = static_cast<float>(radius * radius);
+        InlineStack<int32_t, KDTree::kInlineStackDepth> pending;
+        pending.push(root);
+        while (!pending.empty()) {
+            int32_t index = pending.pop();
+            const Node& node = nodes[index];
+            if (node.available) {
+                float dist = frameDistance(point.data(), node.coord);
+                if (dist <= radiusSq) emit(index, dist);
+            }
+            float diff = point[node.axis] - node.coord[node.axis];
+            if (node.left != kNull && (diff < 0 || diff * diff <= radiusSq)) pending.push(node.left);
+            if (node.right != kNull && (diff >= 0 || diff * diff <= radiusSq)) pending.push(node.right);
+        }
+    }
+
+public:
+    // Fit a frame to `input` and build a balanced tree over it in `layout`
+    // order. Passing `sharedFrame` uses that frame instead, so distances
+    // agree with another structure measured in it.
+    void build(std::vector<Driver> input, NodeLayout layout = NodeLayout::VanEmdeBoas,
+               ShardGeometry placement = ShardGeometry::Local,
+               std::optional<LocalProjection> sharedFrame = std::nullopt) {
+        geometry = placement;
+        frame = sharedFrame ? *sharedFrame : LocalProjection::fitting(input);
+        sinOriginLat = std::sin(frame.originLat * std::numbers::pi / 180.0);
+        cosOriginLat = std::cos(frame.originLat * std::numbers::pi / 180.0);
+        std::vector<FramePoint> projected(input.size());
+        std::vector<ShardPoint> points(input.size());
+        for (size_t i = 0; i < input.size(); ++i) {
+            projected[i] = toFrame(input[i].lat, input[i].lng);
+            points[i] = {{projected[i][0], projected[i][1], projected[i][2]}, i};
+        }
+
+        std::vector<KDTree::BuildNode> shape;
+        shape.reserve(input.size());
+        std::vector<KDTree::BuildRange> work;
+        if (!input.empty()) work.push_back({0, input.size(), 0, kNull, false});
+        KDTree::splitRanges(points, work, shape, 0, nullptr);
+        std::vector<int32_t> order = KDTree::layoutOrder(shape, layout);
+
+        std::vector<int32_t> position(shape.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            position[order[i]] = static_cast<int32_t>(i);
+        }
+
+        nodes.clear();
+        nodes.reserve(shape.size());
+        drivers.clear();
+        drivers.reserve(shape.size());
+        slotById.clear();
+        slotById.reserve(shape.size());
+        for (int32_t logical : order) {
+            const KDTree::BuildNode& built = shape[logical];
+            const FramePoint& at = projected[built.item];
+            nodes.push_back({{at[0], at[1], at[2]},
+                             built.left == kNull ? kNull : position[built.left],
+                             built.right == kNull ? kNull : position[built.right],
+                             static_cast<uint8_t>(built.depth & 1),
+                             input[built.item].available});
+            slotById[input[built.item].id] = static_cast<int32_t>(drivers.size());
+            drivers.push_back(input[built.item]);
+        }
+        root = nodes.empty() ? kNull : position[0];
+    }
+
+    const LocalProjection& projection() const {
+        return frame;
+    }
+
+    ShardGeometry placement() const {
+        return geometry;
+    }
+
+    size_t size() const {
+        return drivers.size();
+    }
+
+    const Driver* driverById(int id) const {
+        auto found = slotById.find(id);
+        return found == slotById.end() ? nullptr : &drivers[found->second];
+    }
+
+    std::vector<Driver> findNearestNeighbors(double targetLat, double targetLng, int k) const {
+        std::vector<Neighbor> best(k > 0 ? static_cast<size_t>(k) : 0);
+        best.resize(nearestSlots(toFrame(targetLat, targetLng), best));
+        std::vector<Driver> result;
+        result.reserve(best.size());
+        for (const Neighbor& hit : best) {
+            result.push_back(drivers[hit.id]);
+        }
+        return result;
+    }
+
+    // Allocation-free, as KDTree's; distances are squared metres
+    size_t findNearestNeighbors(double targetLat, double targetLng, std::span<Neighbor> out) const {
+        size_t filled = nearestSlots(toFrame(targetLat, targetLng), out);
+        for (size_t i = 0; i < filled; ++i) {
+            out[i].id = drivers[out[i].id].id;
+        }
+        return filled;
+    }
+
+    std::span<Neighbor> findNearestNeighbors(double targetLat, double targetLng, int k, QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(k > 0 ? static_cast<size_t>(k) : 0);
+        return out.first(findNearestNeighbors(targetLat, targetLng, out));
+    }
+
+    // All available drivers within `radiusMetres`, in no particular order
+    std::vector<Driver> findWithinRadius(double targetLat, double targetLng, double radiusMetres) const {
+        std::vector<Driver> result;
+        walkWithin(toFrame(targetLat, targetLng), frameRadius(radiusMetres),
+            [&](int32_t slot, float) { result.push_back(drivers[slot]); });
+        return result;
+    }
+
+    // Writes the first out.size() matches and returns how many there are
+    size_t findWithinRadius(double targetLat, double targetLng, double radiusMetres, std::span<Neighbor> out) const {
+        size_t total = 0;
+        walkWithin(toFrame(targetLat, targetLng), frameRadius(radiusMetres), [&](int32_t slot, float dist) {
+            if (total < out.size()) out[total] = {drivers[slot].id, dist};
+            ++total;
+        });
+        return total;
+    }
+
+    std::span<Neighbor> findWithinRadius(double targetLat, double targetLng, double radiusMetres,
+                                         QueryContext& context) const {
+        std::span<Neighbor> out = context.allocate<Neighbor>(KDTree::kRadiusGuess);
+        size_t total = findWithinRadius(targetLat, targetLng, radiusMetres, out);
+        if (total > out.size()) {
+            out = context.allocate<Neighbor>(total);
+            findWithinRadius(targetLat, targetLng, radiusMetres, out);
+        }
+        return out.first(total);
+    }
+};
+
+struct DensityConfig {
+    double cellMetres = 250.0;
+    // Kernel support: a driver further than this from a cell's centre adds
+    // nothing to it
+    double radiusMetres = 750.0;
+    // A driver's weight halves for every half-life since they were last seen
+    std::chrono::milliseconds halfLife{60000};
+};
+
+// Kernel density of available drivers over a fixed grid covering a metro,
+// each driver weighted by an Epanechnikov kernel, 1 - (d/R)^2 inside R, and
+// by how recently they were seen. Decay is global and lazy: cell values are
+// kept scaled to an epoch, with a driver seen at t counted as 2^((t - epoch)
+// / halfLife), so time passing touches nothing and reads multiply by the
+// decay since the epoch. The epoch moves forward, rescaling everything
+// once, before the scale grows large enough to cost precision.
+//
+// rebuild() recomputes every cell by gathering its drivers through a
+// ProjectedShard; observe() and forget() then keep it current, touching only
+// the cells within R of a moved driver's old and new positions. Kernel
+// sums run along rows of cells or lists of distances in blocks of kLanes
+// independent lanes: straight-line code that GCC's SLP pass turns into SIMD
+// at plain -O2, where it won't vectorise a loop needing an epilogue, and
+// without -ffast-math, since no sum is reassociated.
+class SupplyDensity {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // The grid spans [south, north] x [west, east]; `east` may be numerically
+    // below `west` for a metro across the antimeridian
+    SupplyDensity(double south, double west, double north, double east, DensityConfig cfg = {})
+        : config(cfg) {
+        double width = east - west;
+        if (width < 0) width += 360.0;
+        frame = LocalProjection::centeredOn((south + north) / 2, std::remainder(west + width / 2, 360.0));
+        // Centred, so the west edge sits at -x of the east one
+        LocalPoint low = frame.toLocal(south, west);
+        originX = -static_cast<float>(width / 2 * frame.metresPerDegreeLng);
+        originY = low.y;
+        cols = std::max<size_t>(1, static_cast<size_t>(std::ceil(-2.0 * originX / config.cellMetres)));
+        rows = std::max<size_t>(1, static_cast<size_t>(std::ceil((north - south) * LocalProjection::kMetresPerDegree / config.cellMetres)));
+        cells.assign(rows * cols, 0.0);
+        halfLivesPerSecond = 1.0 / std::chrono::duration<double>(config.halfLife).count();
+        epoch = Clock::now();
+    }
+
+    size_t rowCount() const { return rows; }
+    size_t columnCount() const { return cols; }
+    const LocalProjection& projection() const { return frame; }
+
+    // Start over from `drivers`, all taken as seen at `when`. Each cell
+    // centre gathers its neighbourhood from a tree built over them.
+    void rebuild(const std::vector<Driver>& drivers, Clock::time_point when = Clock::now()) {
+        epoch = when;
+        seen.clear();
+        std::vector<Driver> available;
+        for (const Driver& driver : drivers) {
+            if (!driver.available) continue;
+            available.push_back(driver);
+            LocalPoint point = frame.toLocal(driver.lat, driver.lng);
+            seen[driver.id] = {point.x, point.y, 1.0};
+        }
+
+        ProjectedShard shard;
+        shard.build(std::move(available), NodeLayout::VanEmdeBoas, ShardGeometry::Local, frame);
+        // Its own context: one borrowed from the caller's thread would lose
+        // whatever results the caller was still holding at the first reset()
+        QueryContext context;
+        std::vector<double> distances;
+        for (size_t row = 0; row < rows; ++row) {
+            for (size_t col = 0; col < cols; ++col) {
+                auto [lat, lng] = cellCentre(row, col);
+                context.reset();
+                std::span<Neighbor> near = shard.findWithinRadius(lat, lng, config.radiusMetres, context);
+                distances.resize(near.size());
+                for (size_t i = 0; i < near.size(); ++i) distances[i] = near[i].distanceSq;
+                cells[row * cols + col] = kernelSum(distances.data(), distances.size());
+            }
+        }
+    }
+
+    // A driver reported at `when`: their old contribution comes out, and
+    // the new one goes in if they are available
+    void observe(const Driver& driver, Clock::time_point when = Clock::now()) {
+        advanceEpoch(when);
+        auto found = seen.find(driver.id);
+        if (found != seen.end()) {
+            scatter(found->second.x, found->second.y, -found->second.weight);
+            if (!driver.available) {
+                seen.erase(found);
+                return;
+            }
+        } else if (!driver.available) {
+            return;
+        }
+        LocalPoint point = frame.toLocal(driver.lat, driver.lng);
+        double weight = std::exp2(std::chrono::duration<double>(when - epoch).count() * halfLivesPerSecond);
+        seen[driver.id] = {point.x, point.y, weight};
+        scatter(point.x, point.y, weight);
+    }
+
+    void forget(int driverId) {
+        auto found = seen.find(driverId);
+        if (found == seen.end()) return;
+        scatter(found->second.x, found->second.y, -found->second.weight);
+        seen.erase(found);
+    }
+
+    // Density at the cell holding the point, in kernel-weighted drivers
+    double density(double lat, double lng, Clock::time_point now = Clock::now()) const {
+        LocalPoint point = frame.toLocal(lat, lng);
+        double col = std::floor((point.x - originX) / config.cellMetres);
+        double row = std::floor((point.y - originY) / config.cellMetres);
+        if (col < 0 || row < 0 || col >= static_cast<double>(cols) || row >= static_cast<double>(rows)) return 0.0;
+        return std::max(0.0, cells[static_cast<size_t>(row) * cols + static_cast<size_t>(col)] * decayTo(now));
+    }
+
+    // Every cell as of `now`, row-major from the south-west corner
+    std::vector<float> snapshot(Clock::time_point now = Clock::now()) const {
+        double scale = decayTo(now);
+        std::vector<float> result(cells.size());
+        for (size_t i = 0; i < cells.size(); ++i) {
+            result[i] = static_cast<float>(std::max(0.0, cells[i] * scale));
+        }
+        return result;
+    }
+
+    std::pair<double, double> cellCentre(size_t row, size_t col) const {
+        double x = originX + (col + 0.5) * config.cellMetres;
+        double y = originY + (row + 0.5) * config.cellMetres;
+        return {frame.originLat + y / LocalProjection::kMetresPerDegree,
+                std::remainder(frame.originLng + x / frame.metresPerDegreeLng, 360.0)};
+    }
+
+private:
+    struct Seen {
+        float x;
+        float y;
+        // 2^((seen - epoch) / halfLife)
+        double weight;
+    };
+
+    // Rescale once the newest weights pass 2^kMaxScaleExponent
+    static constexpr double kMaxScaleExponent = 32.0;
+    // Lanes per block in the kernel loops: two SSE2 or one AVX register of doubles
+    static constexpr int32_t kLanes = 4;
+
+    DensityConfig config;
+    LocalProjection frame;
+    float originX = 0.0f;
+    float originY = 0.0f;
+    size_t rows = 0;
+    size_t cols = 0;
+    std::vector<double> cells;
+    std::unordered_map<int, Seen> seen;
+    Clock::time_point epoch;
+    double halfLivesPerSecond = 0.0;
+
+    double decayTo(Clock::time_point now) const {
+        return std::exp2(-std::chrono::duration<double>(now - epoch).count() * halfLivesPerSecond);
+    }
+
+    void advanceEpoch(Clock::time_point when) {
+        double exponent = std::chrono::duration<double>(when - epoch).count() * halfLivesPerSecond;
+        if (exponent < kMaxScaleExponent) return;
+        double scale = std::exp2(-exponent);
+        for (double& cell : cells) cell *= scale;
+        for (auto& [id, entry] : seen) entry.weight *= scale;
+        epoch = when;
+    }
+
+    double kernelSum(const double* distancesSq, size_t count) const {
+        double inverse = 1.0 / (config.radiusMetres * config.radiusMetres);
+        double lanes[kLanes] = {};
+        size_t i = 0;
+        for (; i + kLanes <= count; i += kLanes) {
+            for (int32_t lane = 0; lane < kLanes; ++lane) {
+                lanes[lane] += std::max(0.0, 1.0 - distancesSq[i + lane] * inverse);
+            }
+        }
+        double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        for (; i < count; ++i) {
+            sum += std::max(0.0, 1.0 - distancesSq[i] * inverse);
+        }
+        return sum;
+    }
+
+    // Add weight x kernel to every cell whose centre is within R of (x, y)
+    void scatter(float x, float y, double weight) {
+        double radius = config.radiusMetres;
+        double inverse = 1.0 / (radius * radius);
+        double side = config.cellMetres;
+        auto firstCol = static_cast<int64_t>(std::ceil((x - radius - originX) / side - 0.5));
+        auto lastCol = static_cast<int64_t>(std::floor((x + radius - originX) / side - 0.5));
+        auto firstRow = static_cast<int64_t>(std::ceil((y - radius - originY) / side - 0.5));
+        auto lastRow = static_cast<int64_t>(std::floor((y + radius - originY) / side - 0.5));
+        firstCol = std::max<int64_t>(firstCol, 0);
+        firstRow = std::max<int64_t>(firstRow, 0);
+        lastCol = std::min<int64_t>(lastCol, static_cast<int64_t>(cols) - 1);
+        lastRow = std::min<int64_t>(lastRow, static_cast<int64_t>(rows) - 1);
+
+        if (firstCol > lastCol) return;
+        // Locals only in the inner loop, so stores to the row cannot alias them
+        // and a 32-bit index converts to double in vector registers
+        double west = originX + (firstCol + 0.5) * side - x;
+        auto width = static_cast<int32_t>(lastCol - firstCol + 1);
+        for (int64_t row = firstRow; row <= lastRow; ++row) {
+            double dy = originY + (row + 0.5) * side - y;
+            double dySq = dy * dy;
+            double* line = cells.data() + row * cols + firstCol;
+            int32_t i = 0;
+            for (; i + kLanes <= width; i += kLanes) {
+                for (int32_t lane = 0; lane < kLanes; ++lane) {
+                    double dx = west + (i + lane) * side;
+                    line[i + lane] += weight * std::max(0.0, 1.0 - (dx * dx + dySq) * inverse);
+                }
+            }
+            for (; i < width; ++i) {
+                double dx = west + i * side;
+                line[i] += weight * std::max(0.0, 1.0 - (dx * dx + dySq) * inverse);
+            }
+        }
+    }
+};
+
+// Per-driver inputs to ranking beyond position
+struct RatedDriver {
+    Driver driver;
+    float rating = 5.0f;
+    std::chrono::steady_clock::time_point idleSince;
+};
+
+// One candidate's terms as a scoring policy sees them
+struct ScoreTerms {
+    double metres;
+    float rating;
+    double idleSeconds;
+};
+
+// What is known about every driver in a subtree: no nearer than
+// `minMetres`, and each term within its range
+struct ScoreBounds {
+    double minMetres;
+    float minRating;
+    float maxRating;
+    double minIdleSeconds;
+    double maxIdleSeconds;
+};
+
+// Default ranking, lower first: distance, less an allowance for rating and
+// for time spent idle, the latter capped so nobody waits forever. A policy
+// is any type with static score(ScoreTerms) and bound(ScoreBounds); bound
+// must never exceed the score of a driver inside the bounds, or the search
+// is no longer exact.
+struct RatingAndIdleScore {
+    static constexpr double kMetresPerStar = 400.0;
+    static constexpr double kMetresPerIdleMinute = 60.0;
+    static constexpr double kIdleCapMinutes = 20.0;
+
+    static double score(const ScoreTerms& terms) {
+        return terms.metres - kMetresPerStar * terms.rating -
+               kMetresPerIdleMinute * std::min(terms.idleSeconds / 60.0, kIdleCapMinutes);
+    }
+
+    static double bound(const ScoreBounds& bounds) {
+        return bounds.minMetres - kMetresPerStar * bounds.maxRating -
+               kMetresPerIdleMinute * std::min(bounds.maxIdleSeconds / 60.0, kIdleCapMinutes);
+    }
+};
+
+struct ScoredDriver {
+    Driver driver;
+    double score;
+};
+
+// Static tree for ranking by a score mixing distance with rating and idle
+// time, rebuilt with each snapshot as ProjectedShard is. Positions are
+// metres in a frame fitted to the drivers; every node carries the range of
+// rating and idle-since over its subtree, so a search can bound the best
+// score anything below could reach and stay exact while pruning. The
+// policy is a template argument of the query, keeping score() inlined in
+// the inner loop.
+class ScoredShard {
+private:
+    struct Node {
+        float x;
+        float y;
+        int32_t left;
+        int32_t right;
+        float rating;
+        // Seconds after `epoch`
+        float idleSince;
+        float minRating;
+        float maxRating;
+        float minIdleSince;
+        float maxIdleSince;
+        uint8_t axis;
+        bool available;
+    };
+
+    // A deferred subtree, with the target's offset from its cell along each
+    // axis; their squares sum to a lower bound on distance to anything inside
+    struct Frame {
+        int32_t node;
+        float offset[2];
+    };
+
+    static constexpr int32_t kNull = KDTree::kNull;
+
+    LocalProjection frame;
+    std::chrono::steady_clock::time_point epoch;
+    std::vector<Node> nodes;
+    std::vector<Driver> drivers;
+    int32_t root = kNull;
+
+public:
+    void build(std::vector<RatedDriver> input, NodeLayout layout = NodeLayout::VanEmdeBoas) {
+        std::vector<Driver> plain(input.size());
+        for (size_t i = 0; i < input.size(); ++i) plain[i] = input[i].driver;
+        frame = LocalProjection::fitting(plain);
+        epoch = std::chrono::steady_clock::now();
+
+        std::vector<KDTree::BuildPoint> points(input.size());
+        std::vector<LocalPoint> local(input.size());
+        for (size_t i = 0; i < input.size(); ++i) {
+            local[i] = frame.toLocal(input[i].driver.lat, input[i].driver.lng);
+            points[i] = {{local[i].x, local[i].y}, i};
+        }
+        std::vector<KDTree::BuildNode> shape;
+        shape.reserve(input.size());
+        std::vector<KDTree::BuildRange> work;
+        if (!input.empty()) work.push_back({0, input.size(), 0, kNull, false});
+        KDTree::splitRanges(points, work, shape, 0, nullptr);
+
+        // Shape is in preorder, so walking it backwards meets children first
+        std::vector<Node> built(shape.size());
+        for (size_t i = shape.size(); i-- > 0;) {
+            const RatedDriver& rated = input[shape[i].item];
+            float idleSince = std::chrono::duration<float>(rated.idleSince - epoch).count();
+            Node& node = built[i];
+            node = {local[shape[i].item].x, local[shape[i].item].y, shape[i].left, shape[i].right,
+                    rated.rating, idleSince, rated.rating, rated.rating, idleSince, idleSince,
+                    static_cast<uint8_t>(shape[i].depth & 1), rated.driver.available};
+            for (int32_t child : {shape[i].left, shape[i].right}) {
+                if (child == kNull) continue;
+                node.minRating = std::min(node.minRating, built[child].minRating);
+                node.maxRating = std::max(node.maxRating, built[child].maxRating);
+                node.minIdleSince = std::min(node.minIdleSince, built[child].minIdleSince);
+                node.maxIdleSince = std::max(node.maxIdleSince, built[child].maxIdleSince);
+            }
+        }
+
+        std::vector<int32_t> order = KDTree::layoutOrder(shape, layout);
+        std::vector<int32_t> position(shape.size());
+        for (size_t i = 0; i < order.size(); ++i) position[order[i]] = static_cast<int32_t>(i);
+        nodes.clear();
+        nodes.reserve(shape.size());
+        drivers.clear();
+        drivers.reserve(shape.size());
+        for (int32_t logical : order) {
+            Node node = built[logical];
+            node.left = node.left == kNull ? kNull : position[node.left];
+            node.right = node.right == kNull ? kNull : position[node.right];
+            nodes.push_back(node);
+            drivers.push_back(std::move(input[shape[logical].item].driver));
+        }
+        root = nodes.empty() ? kNull : position[0];
+    }
+
+    size_t size() const { return nodes.size(); }
+
+    // The k available drivers with the lowest Policy score at `now`, best first
+    template <typename Policy = RatingAndIdleScore>
+    std::vector<ScoredDriver> findBestScored(double targetLat, double targetLng, int k,
+                                             std::chrono::steady_clock::time_point now =
+                                                 std::chrono::steady_clock::now()) const {
+        std::vector<ScoredDriver> best(k > 0 ? static_cast<size_t>(k) : 0);
+        best.resize(findBestScored<Policy>(targetLat, targetLng, std::span<ScoredDriver>(best), now));
+        return best;
+    }
+
+    // Context variant; the result lives in `context`
+    template <typename Policy = RatingAndIdleScore>
+    std::span<ScoredDriver> findBestScored(double targetLat, double targetLng, int k, QueryContext& context,
+                                           std::chrono::steady_clock::time_point now =
+                                               std::chrono::steady_clock::now()) const {
+        std::span<ScoredDriver> out = context.allocate<ScoredDriver>(k > 0 ? static_cast<size_t>(k) : 0);
+        return out.first(findBestScored<Policy>(targetLat, targetLng, out, now));
+    }
+
+    // Write up to out.size() best drivers into `out`, best first, and return
+    // how many were written
+    template <typename Policy = RatingAndIdleScore>
+    size_t findBestScored(double targetLat, double targetLng, std::span<ScoredDriver> out,
+                          std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now()) const {
+        size_t filled = 0;
+        size_t limit = out.size();
+        if (root == kNull || limit == 0) return 0;
+
+        LocalPoint target = frame.toLocal(targetLat, targetLng);
+        const float point[2] = {target.x, target.y};
+        double elapsed = std::chrono::duration<double>(now - epoch).count();
+        auto worst = [&] { return filled < limit ? std::numeric_limits<double>::infinity() : out[filled - 1].score; };
+        auto subtreeBound = [&](const Node& node, const float offset[2]) {
+            double minDistSq = double(offset[0]) * offset[0] + double(offset[1]) * offset[1];
+            return Policy::bound({std::sqrt(minDistSq), node.minRating, node.maxRating,
+                                  elapsed - node.maxIdleSince, elapsed - node.minIdleSince});
+        };
+
+        InlineStack<Frame, KDTree::kInlineStackDepth> pending;
+        pending.push({root, {0.0f, 0.0f}});
+        while (!pending.empty()) {
+            Frame frame = pending.pop();
+            for (int32_t index = frame.node; index != kNull;) {
+                const Node& node = nodes[index];
+                if (subtreeBound(node, frame.offset) >= worst()) break;
+                if (node.left != kNull) __builtin_prefetch(&nodes[node.left]);
+                if (node.right != kNull) __builtin_prefetch(&nodes[node.right]);
+
+                if (node.available) {
+                    float dx = point[0] - node.x;
+                    float dy = point[1] - node.y;
+                    double score = Policy::score({std::sqrt(double(dx) * dx + double(dy) * dy), node.rating,
+                                                  elapsed - node.idleSince});
+                    if (score < worst()) {
+                        if (filled == limit) --filled;
+                        size_t pos = filled++;
+                        for (; pos > 0 && out[pos - 1].score > score; --pos) out[pos] = out[pos - 1];
+                        out[pos] = {drivers[index], score};
+                    }
+                }
+
+                float diff = point[node.axis] - (node.axis ? node.y : node.x);
+                int32_t nearChild = diff < 0 ? node.left : node.right;
+                int32_t farChild = diff < 0 ? node.right : node.left;
+                if (farChild != kNull) {
+                    Frame far = frame;
+                    far.node = farChild;
+                    far.offset[node.axis] = std::max(std::abs(diff), frame.offset[node.axis]);
+                    pending.push(far);
+                }
+                index = nearChild;
+            }
+        }
+        return filled;
+    }
+};
+
+// A road network node's position
+struct RoadNode {
+    double lat;
+    double lng;
+};
+
+// One directed road segment
+struct RoadEdge {
+    int32_t from;
+    int32_t to;
+    float seconds;
+};
+
+// Road network used to re-rank straight-line candidates by travel time. Edges
+// are stored reversed, as adjacency arrays, since every search starts at a
+// pickup point and walks backwards to learn how long each nearby node takes
+// to drive there.
+class RoadGraph {
+public:
+    // Text format: a "<nodes> <edges>" header, one "<lat> <lng>" line per
+    // node (ids follow line order), then one "<from> <to> <seconds>" line per
+    // edge. Returns false, leaving the graph empty, if the file is missing or
+    // malformed.
+    bool load(const std::string& path) {
+        std::ifstream in(path);
+        size_t nodeCount = 0;
+        size_t edgeCount = 0;
+        std::vector<RoadNode> nodes;
+        std::vector<RoadEdge> edges;
+        bool ok = static_cast<bool>(in >> nodeCount >> edgeCount);
+        if (ok) {
+            // A node line takes at least 4 bytes ("0 0\n") and an edge line 6,
+            // so a count the rest of the file can't hold means it is truncated
+            // or corrupt; checked before resizing so it can't throw bad_alloc
+            std::streamoff header = in.tellg();
+            in.seekg(0, std::ios::end);
+            std::streamoff end = in.tellg();
+            in.seekg(header);
+            auto remaining = static_cast<size_t>(std::max<std::streamoff>(end - header, 0));
+            ok = header >= 0 && in && nodeCount <= remaining / 4 && edgeCount <= (remaining - nodeCount * 4) / 6;
+        }
+        if (ok) {
+            nodes.resize(nodeCount);
+            edges.resize(edgeCount);
+        }
+        for (size_t i = 0; ok && i < nodeCount; ++i) {
+            ok = static_cast<bool>(in >> nodes[i].lat >> nodes[i].lng);
+        }
+        for (size_t i = 0; ok && i < edgeCount; ++i) {
+            RoadEdge& edge = edges[i];
+            ok = in >> edge.from >> edge.to >> edge.seconds && edge.from >= 0 && edge.to >= 0 &&
+                 static_cast<size_t>(edge.from) < nodeCount && static_cast<size_t>(edge.to) < nodeCount &&
+                 edge.seconds >= 0;
+        }
+        if (!ok) {
+            nodes.clear();
+            edges.clear();
+        }
+        build(std::move(nodes), edges);
+        return ok;
+    }
+
+    void build(std::vector<RoadNode> nodes, std::span<const RoadEdge> edges) {
+        positions = std::move(nodes);
+        firstIn.assign(positions.size() + 1, 0);
+        for (const RoadEdge& edge : edges) ++firstIn[edge.to + 1];
+        for (size_t i = 1; i < firstIn.size(); ++i) firstIn[i] += firstIn[i - 1];
+        tails.resize(edges.size());
+        costs.resize(edges.size());
+        std::vector<uint32_t> fill(firstIn.begin(), firstIn.end() - 1);
+        for (const RoadEdge& edge : edges) {
+            uint32_t slot = fill[edge.to]++;
+            tails[slot] = edge.from;
+            costs[slot] = edge.seconds;
+        }
+
+        std::vector<Driver> points(positions.size());
+        for (size_t i = 0; i < positions.size(); ++i) {
+            points[i].id = static_cast<int>(i);
+            points[i].lat = positions[i].lat;
+            points[i].lng = positions[i].lng;
+            points[i].available = true;
+        }
+        snapIndex.build(std::move(points));
+    }
+
+    size_t nodeCount() const {
+        return positions.size();
+    }
+
+    // Frame fitted to the nodes, shared by anything that grids the same metro
+    const LocalProjection& projection() const {
+        return snapIndex.projection();
+    }
+
+    // Closest node to a point, with the distance to it in metres; node -1 on
+    // an empty graph
+    std::pair<int32_t, double> snap(double lat, double lng) const {
+        std::array<Neighbor, 1> nearest;
+        if (snapIndex.findNearestNeighbors(lat, lng, std::span<Neighbor>(nearest)) == 0) return {-1, 0.0};
+        return {nearest[0].id, std::sqrt(nearest[0].distanceSq)};
+    }
+
+    // Seconds to drive from every node that can reach `target` within
+    // `horizonSeconds`, sorted by node. Scratch space is per thread and only
+    // the nodes touched are reset, so a search costs what it explores.
+    std::vector<std::pair<int32_t, float>> timesTo(int32_t target, double horizonSeconds) const {
+        struct Scratch {
+            std::vector<float> best;
+            std::vector<int32_t> touched;
+            std::vector<std::pair<float, int32_t>> heap;
+        };
+        thread_local Scratch scratch;
+        constexpr float kUnreached = std::numeric_limits<float>::infinity();
+        if (scratch.best.size() < positions.size()) scratch.best.assign(positions.size(), kUnreached);
+
+        std::vector<std::pair<int32_t, float>> reached;
+        if (target < 0 || static_cast<size_t>(target) >= positions.size()) return reached;
+
+        auto later = [](const std::pair<float, int32_t>& a, const std::pair<float, int32_t>& b) {
+            return a.first > b.first;
+        };
+        const float horizon = static_cast<float>(horizonSeconds);
+        scratch.best[target] = 0.0f;
+        scratch.touched.push_back(target);
+        scratch.heap.push_back({0.0f, target});
+        while (!scratch.heap.empty()) {
+            std::pop_heap(scratch.heap.begin(), scratch.heap.end(), later);
+            auto [seconds, node] = scratch.heap.back();
+            scratch.heap.pop_back();
+            if (seconds > scratch.best[node]) continue;
+            reached.push_back({node, seconds});
+            for (uint32_t edge = firstIn[node]; edge < firstIn[node + 1]; ++edge) {
+                int32_t tail = tails[edge];
+                float arrival = seconds + costs[edge];
+                if (arrival > horizon || arrival >= scratch.best[tail]) continue;
+                if (scratch.best[tail] == kUnreached) scratch.touched.push_back(tail);
+                scratch.best[tail] = arrival;
+                scratch.heap.push_back({arrival, tail});
+                std::push_heap(scratch.heap.begin(), scratch.heap.end(), later);
+            }
+        }
+
+        for (int32_t node : scratch.touched) scratch.best[node] = kUnreached;
+        scratch.touched.clear();
+        std::sort(reached.begin(), reached.end());
+        return reached;
+    }
+
+private:
+    std::vector<RoadNode> positions;
+    // Edges into node n are [firstIn[n], firstIn[n + 1])
+    std::vector<uint32_t> firstIn;
+    std::vector<int32_t> tails;
+    std::vector<float> costs;
+    ProjectedShard snapIndex;
+};
+
+// Pointy-top hexagons of a fixed size laid over a projected frame. A cell is
+// its axial (q, r) coordinate packed into 64 bits.
+struct HexGrid {
+    LocalProjection frame;
+    // Centre to corner, in metres
+    double cellMetres = 150.0;
+
+    uint64_t cellOf(double lat, double lng) const {
+        LocalPoint point = frame.toLocal(lat, lng);
+        double q = (std::sqrt(3.0) / 3.0 * point.x - point.y / 3.0) / cellMetres;
+        double r = (2.0 / 3.0 * point.y) / cellMetres;
+        // Round in cube coordinates, fixing up whichever axis moved most
+        double s = -q - r;
+        double rq = std::round(q);
+        double rr = std::round(r);
+        double rs = std::round(s);
+        double dq = std::abs(rq - q);
+        double dr = std::abs(rr - r);
+        double ds = std::abs(rs - s);
+        if (dq > dr && dq > ds) {
+            rq = -rr - rs;
+        } else if (dr > ds) {
+            rr = -rq - rs;
+        }
+        return (static_cast<uint64_t>(static_cast<uint32_t>(static_cast<int32_t>(rq))) << 32) |
+               static_cast<uint32_t>(static_cast<int32_t>(rr));
+    }
+};
+
+struct EtaCacheConfig {
+    double cellMetres = 50.0;
+    // Entries older than this are misses; traffic moves on
+    std::chrono::milliseconds ttl{60000};
+    // Entries across all shards
+    size_t capacity = 1 << 16;
+    size_t shards = 16;
+};
+
+struct EtaCacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    // Misses that found an entry past its TTL or from before expireAll()
+    uint64_t expired = 0;
+    uint64_t evictions = 0;
+
+    double hitRatio() const {
+        uint64_t lookups = hits + misses;
+        return lookups == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(lookups);
+    }
+};
+
+// Drive time from one hex cell to another, shared by every query whose
+// driver and pickup fall in the same pair of cells. Shards each hold a fixed
+// ring of slots under their own lock and evict with CLOCK: a hit only sets a
+// reference bit, and the hand clears bits until it finds a slot to reuse.
+class EtaCache {
+public:
+    EtaCache(const LocalProjection& frame, EtaCacheConfig cfg = {})
+        : grid{frame, cfg.cellMetres}, config(cfg), shards(std::max<size_t>(1, cfg.shards)) {
+        size_t perShard = std::max<size_t>(1, config.capacity / shards.size());
+        for (Shard& shard : shards) {
+            shard.slots.resize(perShard);
+            shard.index.reserve(perShard);
+        }
+    }
+
+    EtaCache(const EtaCache&) = delete;
+    EtaCache& operator=(const EtaCache&) = delete;
+
+    uint64_t cellOf(double lat, double lng) const {
+        return grid.cellOf(lat, lng);
+    }
+
+    bool lookup(uint64_t from, uint64_t to, float& seconds) {
+        CellPair key{from, to};
+        Shard& shard = shardFor(key);
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        if (found == shard.index.end()) {
+            ++shard.stats.misses;
+            return false;
+        }
+        Slot& slot = shard.slots[found->second];
+        if (slot.generation != generation.load(std::memory_order_acquire) || now - slot.stored > config.ttl) {
+            ++shard.stats.misses;
+            ++shard.stats.expired;
+            return false;
+        }
+        ++shard.stats.hits;
+        slot.referenced = true;
+        seconds = slot.seconds;
+        return true;
+    }
+
+    void store(uint64_t from, uint64_t to, float seconds) {
+        CellPair key{from, to};
+        Shard& shard = shardFor(key);
+        auto now = std::chrono::steady_clock::now();
+        uint32_t current = generation.load(std::memory_order_acquire);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.index.find(key);
+        size_t index;
+        if (found != shard.index.end()) {
+            index = found->second;
+        } else {
+            index = advanceHand(shard);
+            shard.index.emplace(key, index);
+        }
+        shard.slots[index] = {key, seconds, current, now, false, true};
+    }
+
+    // Drop every entry at once, e.g. when a traffic feed changes edge costs
+    void expireAll() {
+        generation.fetch_add(1, std::memory_order_acq_rel);
+    }
+
+    EtaCacheStats stats() const {
+        EtaCacheStats total;
+        for (const Shard& shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            total.hits += shard.stats.hits;
+            total.misses += shard.stats.misses;
+            total.expired += shard.stats.expired;
+            total.evictions += shard.stats.evictions;
+        }
+        return total;
+    }
+
+private:
+    struct CellPair {
+        uint64_t from;
+        uint64_t to;
+        bool operator==(const CellPair&) const = default;
+    };
+
+    struct CellPairHash {
+        size_t operator()(const CellPair& pair) const {
+            uint64_t h = pair.from * 0x9E3779B97F4A7C15ull ^ (pair.to + 0x632BE59BD9B4E019ull);
+            return static_cast<size_t>(h ^ (h >> 29));
+        }
+    };
+
+    struct Slot {
+        CellPair key;
+        float seconds;
+        uint32_t generation;
+        std::chrono::steady_clock::time_point stored;
+        bool referenced;
+        bool used;
+    };
+
+    struct alignas(64) Shard {
+        mutable std::mutex mutex;
+        std::vector<Slot> slots;
+        std::unordered_map<CellPair, size_t, CellPairHash> index;
+        size_t hand = 0;
+        EtaCacheStats stats;
+    };
+
+    HexGrid grid;
+    EtaCacheConfig config;
+    std::vector<Shard> shards;
+    std::atomic<uint32_t> generation{0};
+
+    Shard& shardFor(const CellPair& key) {
+        return shards[(CellPairHash()(key) >> 7) % shards.size()];
+    }
+
+    // Slot to overwrite: the first unused one, else the first the hand finds
+    // unreferenced since its last pass
+    static size_t advanceHand(Shard& shard) {
+        while (true) {
+            size_t index = shard.hand;
+            shard.hand = (shard.hand + 1) % shard.slots.size();
+            Slot& slot = shard.slots[index];
+            if (!slot.used) return index;
+            if (slot.referenced) {
+                slot.referenced = false;
+                continue;
+            }
+            shard.index.erase(slot.key);
+            ++shard.stats.evictions;
+            return index;
+        }
+    }
+};
+
+struct RerankConfig {
+    // Straight-line candidates fetched per query before re-ranking
+    int candidates = 32;
+    // Drivers further than this by road rank after every reachable one
+    double horizonSeconds = 900.0;
+    // Speed over the stretch between a point and the node it snaps to
+    double offRoadMetresPerSecond = 5.0;
+    // Pickup nodes whose reverse search is kept, least recently used first out
+    size_t cachedOrigins = 4096;
+};
+
+struct RankedDriver {
+    Driver driver;
+    // Infinite when the driver cannot arrive within the horizon
+    double etaSeconds;
+};
+
+struct RerankStats {
+    uint64_t queries = 0;
+    // Queries whose every candidate came out of the ETA cache
+    uint64_t answeredFromCache = 0;
+    uint64_t originHits = 0;
+    uint64_t originMisses = 0;
+    // Reverse searches actually run, and the time spent in them
+    uint64_t searches = 0;
+    double searchMs = 0.0;
+
+    // Search time the caches saved, priced at the mean cost of a search.
+    // A query counts its search before it counts itself, so a snapshot taken
+    // while queries are in flight can hold more searches than queries.
+    double savedMs() const {
+        uint64_t avoided = queries > searches ? queries - searches : 0;
+        return searches == 0 ? 0.0 : searchMs * static_cast<double>(avoided) / static_cast<double>(searches);
+    }
+};
+
+// Second ranking stage: takes the `candidates` nearest drivers by straight
+// line from any index and orders them by road travel time to the rider, so a
+// driver across a river no longer beats one down the street. Each search
+// runs backwards from the rider's snapped node out to the horizon; the
+// result is cached per node, so riders in hot pickup spots share one search.
+// With an EtaCache attached, candidates whose (driver cell, pickup cell) pair
+// is cached skip snapping and searching altogether.
+class RoadReranker {
+public:
+    explicit RoadReranker(const RoadGraph& roads, RerankConfig cfg = {}) : graph(roads), config(cfg) {}
+
+    RoadReranker(const RoadReranker&) = delete;
+    RoadReranker& operator=(const RoadReranker&) = delete;
+
+    // The cache must outlive the reranker or be detached with nullptr
+    void setEtaCache(EtaCache* cache) {
+        etaCache = cache;
+    }
+
+    // The k best of `index`'s straight-line candidates by ETA, fastest first.
+    // Unreachable drivers keep their straight-line order behind the rest.
+    template <typename Index>
+    std::vector<RankedDriver> findNearestByTravelTime(const Index& index, double targetLat, double targetLng, int k) {
+        std::vector<Driver> candidates = index.findNearestNeighbors(targetLat, targetLng, std::max(k, config.candidates));
+        std::vector<RankedDriver> ranked;
+        ranked.reserve(candidates.size());
+        uint64_t pickupCell = etaCache ? etaCache->cellOf(targetLat, targetLng) : 0;
+        // Snapped and searched only once some candidate misses the cache
+        std::pair<int32_t, double> pickup{-1, 0.0};
+        std::shared_ptr<const Reach> reach;
+
+        bool allCached = true;
+        for (const Driver& driver : candidates) {
+            uint64_t startCell = etaCache ? etaCache->cellOf(driver.lat, driver.lng) : 0;
+            float eta;
+            if (etaCache && etaCache->lookup(startCell, pickupCell, eta)) {
+                ranked.push_back({driver, eta});
+                continue;
+            }
+            allCached = false;
+            if (!reach) {
+                pickup = graph.snap(targetLat, targetLng);
+                reach = reachTo(pickup.first);
+            }
+            eta = std::numeric_limits<float>::infinity();
+            auto [start, startOffRoad] = graph.snap(driver.lat, driver.lng);
+            auto found = std::lower_bound(reach->begin(), reach->end(), std::make_pair(start, 0.0f));
+            if (found != reach->end() && found->first == start) {
+                eta = found->second + static_cast<float>((startOffRoad + pickup.second) / config.offRoadMetresPerSecond);
+            }
+            if (etaCache) etaCache->store(startCell, pickupCell, eta);
+            ranked.push_back({driver, eta});
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ++counters.queries;
+            counters.answeredFromCache += allCached && !candidates.empty();
+        }
+        std::stable_sort(ranked.begin(), ranked.end(),
+            [](const RankedDriver& a, const RankedDriver& b) { return a.etaSeconds < b.etaSeconds; });
+        if (ranked.size() > static_cast<size_t>(std::max(k, 0))) ranked.resize(std::max(k, 0));
+        return ranked;
+    }
+
+    RerankStats stats() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return counters;
+    }
+
+private:
+    // Nodes that reach one pickup node within the horizon, sorted by node
+    using Reach = std::vector<std::pair<int32_t, float>>;
+
+    struct CachedReach {
+        std::shared_ptr<const Reach> reach;
+        std::list<int32_t>::iterator recency;
+    };
+
+    const RoadGraph& graph;
+    RerankConfig config;
+    EtaCache* etaCache = nullptr;
+    mutable std::mutex mutex;
+    std::unordered_map<int32_t, CachedReach> cache;
+    // Most recently used at the front
+    std::list<int32_t> recency;
+    RerankStats counters;
+
+    // The search is run outside the lock; two threads missing on the same
+    // node both search and the second result wins, which is harmless
+    std::shared_ptr<const Reach> reachTo(int32_t pickup) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = cache.find(pickup);
+            if (found != cache.end()) {
+                ++counters.originHits;
+                recency.splice(recency.begin(), recency, found->second.recency);
+                return found->second.reach;
+            }
+            ++counters.originMisses;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        auto reach = std::make_shared<const Reach>(graph.timesTo(pickup, config.horizonSeconds));
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::lock_guard<std::mutex> lock(mutex);
+        ++counters.searches;
+        counters.searchMs += elapsed.count();
+        if (config.cachedOrigins == 0) return reach;
+        auto [slot, inserted] = cache.try_emplace(pickup);
+        if (inserted) {
+            recency.push_front(pickup);
+            slot->second.recency = recency.begin();
+            if (cache.size() > config.cachedOrigins) {
+                cache.erase(recency.back());
+                recency.pop_back();
+            }
+        }
+        slot->second.reach = reach;
+        return reach;
+    }
+};
+
+#ifdef KDTREE_COUNT_ALLOCATIONS
+// Count every heap allocation in the process, so `--bench allocs` can check
+// that steady-state queries make none. Off by default since it puts an
+// atomic increment on every allocation.
+namespace allocation_counter {
+std::atomic<size_t> calls{0};
+}
+
+// All kept out of line so GCC pairs callers with new/delete, not malloc/free
+[[gnu::noinline]] void* operator new(size_t size) {
+    allocation_counter::calls.fetch_add(1, std::memory_order_relaxed);
+    if (void* block = std::malloc(size ? size : 1)) return block;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void* operator new(size_t size, std::align_val_t align) {
+    allocation_counter::calls.fetch_add(1, std::memory_order_relaxed);
+    size_t alignment = static_cast<size_t>(align);
+    if (void* block = std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment)) return block;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* block) noexcept { std::free(block); }
+[[gnu::noinline]] void operator delete(void* block, size_t) noexcept { std::free(block); }
+[[gnu::noinline]] void operator delete(void* block, std::align_val_t) noexcept { std::free(block); }
+[[gnu::noinline]] void operator delete(void* block, size_t, std::align_val_t) noexcept { std::free(block); }
+#endif
+
+// Micro-benchmarks, run with `--bench`
+namespace bench {
+
+template <typename Fn>
+double timeMs(Fn&& fn) {
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+std::vector<Driver> randomDrivers(size_t count, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> lat(40.55, 40.90);
+    std::uniform_real_distribution<double> lng(-74.15, -73.70);
+    std::vector<Driver> drivers;
+    drivers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        drivers.push_back({static_cast<int>(i), lat(rng), lng(rng), "driver", true});
+    }
+    return drivers;
+}
+
+// Ids of the k drivers nearest the target among those `keep` accepts, by
+// scanning all of them; the reference the pruned searches are checked against
+template <typename Keep>
+std::vector<int> scanNearest(const std::vector<Driver>& drivers, double lat, double lng, size_t k, Keep&& keep) {
+    std::vector<std::pair<double, int>> kept;
+    for (const Driver& d : drivers) {
+        if (keep(d)) kept.push_back({KDTree::squaredDistance(lat, lng, d.lat, d.lng), d.id});
+    }
+    k = std::min(k, kept.size());
+    std::partial_sort(kept.begin(), kept.begin() + k, kept.end());
+    std::vector<int> ids(k);
+    for (size_t i = 0; i < k; ++i) ids[i] = kept[i].second;
+    return ids;
+}
+
+// How many of `riders` get the same k nearest ids from both indexes
+template <typename A, typename B>
+size_t agreeingQueries(const A& a, const B& b, const std::vector<Query>& riders, int k) {
+    size_t agree = 0;
+    for (const Query& rider : riders) {
+        std::vector<Driver> x = a.findNearestNeighbors(rider.lat, rider.lng, k);
+        std::vector<Driver> y = b.findNearestNeighbors(rider.lat, rider.lng, k);
+        bool match = x.size() == y.size();
+        for (size_t i = 0; match && i < x.size(); ++i) match = x[i].id == y[i].id;
+        agree += match;
+    }
+    return agree;
+}
+
+std::vector<Query> randomRiders(size_t count, uint32_t seed) {
+    std::vector<Query> riders;
+    for (const Driver& d : randomDrivers(count, seed)) riders.push_back({d.lat, d.lng});
+    return riders;
+}
+
+void traversal(const char* label, std::vector<Driver> drivers, size_t queries) {
+    KDTree tree;
+    double insertMs = timeMs([&] { for (const auto& d : drivers) tree.insert(d); });
+
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<size_t> pick(0, drivers.size() - 1);
+    size_t found = 0;
+    double searchMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[pick(rng)];
+            found += tree.findNearestNeighbors(d.lat + 1e-4, d.lng - 1e-4, 5).size();
+        }
+    });
+
+    size_t removals = std::min<size_t>(drivers.size() / 10, 1000);
+    double removeMs = timeMs([&] { for (size_t i = 0; i < removals; ++i) tree.remove(drivers[pick(rng)]); });
+
+    std::cout << label << ": n=" << drivers.size()
+              << " insert " << insertMs << " ms"
+              << ", " << queries << " x 5-NN " << searchMs << " ms"
+              << ", " << removals << " removes " << removeMs << " ms"
+              << " (" << found << " hits)" << std::endl;
+}
+
+void layouts(size_t count, size_t queries) {
+    const std::pair<const char*, NodeLayout> variants[] = {
+        {"dfs", NodeLayout::DepthFirst},
+        {"bfs", NodeLayout::BreadthFirst},
+        {"veb", NodeLayout::VanEmdeBoas},
+    };
+    std::vector<Driver> drivers = randomDrivers(count, 3);
+    for (const auto& [label, layout] : variants) {
+        KDTree tree;
+        double buildMs = timeMs([&] { tree.build(drivers, layout); });
+
+        std::mt19937 rng(11);
+        std::uniform_int_distribution<size_t> pick(0, drivers.size() - 1);
+        size_t found = 0;
+        double searchMs = timeMs([&] {
+            for (size_t i = 0; i < queries; ++i) {
+                const Driver& d = drivers[pick(rng)];
+                found += tree.findNearestNeighbors(d.lat + 1e-4, d.lng - 1e-4, 5).size();
+            }
+        });
+        std::cout << "layout " << label << ": n=" << count
+                  << " build " << buildMs << " ms"
+                  << ", " << queries << " x 5-NN " << searchMs << " ms"
+                  << " (" << found << " hits)" << std::endl;
+    }
+}
+
+void batched(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 4);
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+
+    std::mt19937 rng(13);
+    std::uniform_int_distribution<size_t> pick(0, drivers.size() - 1);
+    std::vector<Query> batch;
+    batch.reserve(queries);
+    for (size_t i = 0; i < queries; ++i) {
+        const Driver& d = drivers[pick(rng)];
+        batch.push_back({d.lat + 1e-4, d.lng - 1e-4});
+    }
+
+    size_t found = 0;
+    double singleMs = timeMs([&] {
+        for (const Query& q : batch) found += tree.findNearestNeighbors(q.lat, q.lng, 5).size();
+    });
+    double steppedMs = timeMs([&] {
+        for (const auto& result : tree.findNearestNeighborsBatch(batch, 5)) found += result.size();
+    });
+    double coroutineMs = timeMs([&] {
+        for (const auto& result : tree.findNearestNeighborsBatch(batch, 5, BatchStrategy::Coroutine)) {
+            found += result.size();
+        }
+    });
+    std::cout << "batch: n=" << count << ", " << queries << " x 5-NN"
+              << " one-at-a-time " << singleMs << " ms"
+              << ", stepped " << steppedMs << " ms"
+              << ", coroutines " << coroutineMs << " ms"
+              << " (" << found << " hits)" << std::endl;
+}
+
+void degenerate() {
+    // Sorted input degenerates into a linked list, which used to overflow the stack
+    std::vector<Driver> chain = randomDrivers(20000, 2);
+    for (size_t i = 0; i < chain.size(); ++i) {
+        chain[i].lat = 40.0 + i * 1e-5;
+        chain[i].lng = -74.0 + i * 1e-5;
+    }
+    traversal("degenerate", chain, 2000);
+}
+
+void pooled(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 5);
+    std::vector<Query> batch;
+    for (size_t i = 0; i < queries; ++i) {
+        batch.push_back({drivers[i % count].lat, drivers[i % count].lng});
+    }
+
+    ThreadPool workers(ThreadPoolConfig{0, true, 256});
+    for (ThreadPool* pool : {static_cast<ThreadPool*>(nullptr), &workers}) {
+        KDTree tree;
+        tree.setThreadPool(pool);
+        double buildMs = timeMs([&] { tree.build(drivers, NodeLayout::VanEmdeBoas); });
+        size_t found = 0;
+        double knnMs = timeMs([&] {
+            for (const auto& result : tree.findNearestNeighborsBatch(batch, 5)) found += result.size();
+        });
+        double radiusMs = timeMs([&] {
+            for (const auto& result : tree.findWithinRadiusBatch(batch, 0.0005)) found += result.size();
+        });
+        std::cout << (pool ? "pool x" : "serial") << (pool ? std::to_string(pool->size()) : "")
+                  << ": n=" << count << " build " << buildMs << " ms"
+                  << ", " << queries << " x 5-NN " << knnMs << " ms"
+                  << ", radius " << radiusMs << " ms"
+                  << " (" << found << " hits)" << std::endl;
+    }
+}
+
+void replicated(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 6);
+    for (bool replicate : {false, true}) {
+        ReplicatedIndex index(replicate);
+        double publishMs = timeMs([&] { index.publish(drivers); });
+
+        std::vector<Driver> moved(drivers.begin(), drivers.begin() + count / 100);
+        for (Driver& d : moved) d.lat += 1e-4;
+        double updateMs = timeMs([&] { index.applyUpdates(moved); });
+
+        size_t found = 0;
+        double searchMs = timeMs([&] {
+            for (size_t i = 0; i < queries; ++i) {
+                const Driver& d = drivers[(i * 7919) % count];
+                found += index.findNearestNeighbors(d.lat, d.lng, 5).size();
+            }
+        });
+        std::cout << "replicas " << index.replicaCount() << ": n=" << count
+                  << " publish " << publishMs << " ms"
+                  << ", " << moved.size() << " updates " << updateMs << " ms"
+                  << ", " << queries << " x 5-NN " << searchMs << " ms"
+                  << " (" << found << " hits)" << std::endl;
+    }
+}
+
+void updates(size_t count, size_t moves) {
+    std::vector<Driver> drivers = randomDrivers(count, 8);
+    std::mt19937 rng(17);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    std::normal_distribution<double> jitter(0.0, 2e-4);
+    std::vector<Update> batch;
+    batch.reserve(moves);
+    for (size_t i = 0; i < moves; ++i) {
+        Driver moved = drivers[pick(rng)];
+        moved.lat += jitter(rng);
+        moved.lng += jitter(rng);
+        batch.push_back({moved, UpdateKind::Upsert});
+    }
+
+    KDTree oneByOne;
+    oneByOne.build(drivers, NodeLayout::VanEmdeBoas);
+    double singleMs = timeMs([&] { for (const Update& u : batch) oneByOne.update(u.driver); });
+
+    KDTree batched;
+    batched.build(drivers, NodeLayout::VanEmdeBoas);
+    double batchMs = timeMs([&] { batched.applyBatch(batch); });
+
+    std::cout << "updates: n=" << count << ", " << moves << " GPS moves"
+              << " one-by-one " << singleMs << " ms"
+              << ", applyBatch " << batchMs << " ms" << std::endl;
+}
+
+// Applies the same batches to one tree through applyBatch and to another one
+// write at a time, and returns false if their answers ever differ. The
+// batches aim at each path through routeBatch: GPS noise that leaves leaves
+// in their cells (updated in place), most of one district moving (subtree
+// rebuilt), and scattered jumps, removes, new drivers and repeated ids
+// (erase and re-insert).
+bool batchMatchesSequential(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 30);
+    KDTree batched;
+    KDTree sequential;
+    batched.build(drivers, NodeLayout::VanEmdeBoas);
+    sequential.build(drivers, NodeLayout::VanEmdeBoas);
+    std::vector<Query> riders = randomRiders(queries, 31);
+
+    std::mt19937 rng(32);
+    std::uniform_real_distribution<double> lat(40.55, 40.90);
+    std::uniform_real_distribution<double> lng(-74.15, -73.70);
+    std::uniform_real_distribution<double> noise(-1e-9, 1e-9);
+    std::uniform_real_distribution<double> drift(-1e-3, 1e-3);
+    int nextId = static_cast<int>(count);
+
+    std::vector<std::pair<const char*, std::vector<Update>>> rounds;
+    std::vector<Update> inPlace;
+    for (Driver& d : drivers) {
+        if (rng() % 5 != 0) continue;
+        d.lat += noise(rng);
+        d.lng += noise(rng);
+        inPlace.push_back({d, UpdateKind::Upsert});
+    }
+    rounds.push_back({"in place", std::move(inPlace)});
+
+    std::vector<Update> district;
+    for (Driver& d : drivers) {
+        if (d.lat >= 40.60 || rng() % 10 == 0) continue;
+        d.lat = std::min(d.lat + drift(rng), 40.5999);
+        d.lng += drift(rng);
+        district.push_back({d, UpdateKind::Upsert});
+    }
+    rounds.push_back({"rebuild", std::move(district)});
+
+    std::vector<Update> scattered;
+    for (size_t i = 0; i < count / 100; ++i) {
+        Driver& d = drivers[rng() % count];
+        if (i % 10 == 0) {
+            scattered.push_back({d, UpdateKind::Remove});
+            continue;
+        }
+        d.lat = lat(rng);
+        d.lng = lng(rng);
+        scattered.push_back({d, UpdateKind::Upsert});
+        if (i % 7 == 0) {
+            d.lat = lat(rng);
+            scattered.push_back({d, UpdateKind::Upsert});
+        }
+        if (i % 5 == 0) {
+            scattered.push_back({Driver{nextId++, lat(rng), lng(rng), "driver", true}, UpdateKind::Upsert});
+        }
+    }
+    rounds.push_back({"re-insert", std::move(scattered)});
+
+    bool ok = true;
+    for (const auto& [label, batch] : rounds) {
+        batched.applyBatch(batch);
+        for (const Update& change : batch) {
+            if (change.kind == UpdateKind::Remove) sequential.remove(change.driver);
+            else sequential.update(change.driver);
+        }
+        size_t agree = agreeingQueries(batched, sequential, riders, 5);
+        bool passed = agree == riders.size() && batched.size() == sequential.size();
+        ok &= passed;
+        std::cout << "  applyBatch vs one at a time, " << label << " (" << batch.size() << " changes): "
+                  << agree << "/" << riders.size() << " identical, size " << batched.size() << " / "
+                  << sequential.size() << (passed ? "" : " FAILED") << std::endl;
+    }
+    return ok;
+}
+
+// Returns false if the tree answers differently from one freshly built
+// from the surviving drivers, before or after compaction
+bool churn(size_t count, size_t queries) {
+    // A shift ends across the southern quarter of the city
+    std::vector<Driver> drivers = randomDrivers(count, 10);
+    std::vector<Driver> leaving;
+    for (const Driver& d : drivers) {
+        if (d.lat < 40.64) leaving.push_back(d);
+    }
+
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+    double removeMs = timeMs([&] { for (const Driver& d : leaving) tree.remove(d); });
+    size_t tombstones = tree.tombstoneCount();
+
+    auto search = [&] {
+        size_t found = 0;
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += tree.findNearestNeighbors(d.lat, d.lng, 5).size();
+        }
+        return found;
+    };
+    size_t found = 0;
+    double dirtyMs = timeMs([&] { found += search(); });
+    size_t reclaimed = 0;
+    double compactMs = timeMs([&] { reclaimed = tree.compact(); });
+    double cleanMs = timeMs([&] { found += search(); });
+
+    // Then scattered removes and re-adds everywhere, and compaction again
+    std::vector<Driver> survivors;
+    for (const Driver& d : drivers) {
+        if (d.lat >= 40.64) survivors.push_back(d);
+    }
+    std::mt19937 rng(37);
+    std::vector<Query> riders = randomRiders(queries / 10, 38);
+    KDTree fresh;
+    fresh.build(survivors, NodeLayout::VanEmdeBoas);
+    size_t compacted = agreeingQueries(tree, fresh, riders, 5);
+    std::vector<Driver> kept;
+    for (const Driver& d : survivors) {
+        if (rng() % 3 == 0) tree.remove(d);
+        else kept.push_back(d);
+    }
+    for (size_t i = 0; i < survivors.size() / 10; ++i) {
+        const Driver& d = survivors[rng() % survivors.size()];
+        if (tree.contains(d.id)) continue;
+        tree.insert(d);
+        kept.push_back(d);
+    }
+    KDTree refreshed;
+    refreshed.build(kept, NodeLayout::VanEmdeBoas);
+    size_t churned = agreeingQueries(tree, refreshed, riders, 5);
+    tree.compact();
+    size_t recompacted = agreeingQueries(tree, refreshed, riders, 5);
+    bool passed = compacted == riders.size() && churned == riders.size() && recompacted == riders.size() &&
+                  tree.size() == refreshed.size();
+
+    std::cout << "churn: n=" << count << ", " << leaving.size() << " removes " << removeMs << " ms"
+              << " (" << tombstones << " tombstones)"
+              << "; " << queries << " x 5-NN " << dirtyMs << " ms"
+              << ", compact " << compactMs << " ms (" << reclaimed << " reclaimed)"
+              << ", 5-NN again " << cleanMs << " ms"
+              << " (" << found << " hits); vs a fresh build " << compacted << ", after more churn " << churned
+              << ", compacted again " << recompacted << " of " << riders.size() << " identical"
+              << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+void versioned(size_t count, size_t batches, size_t batchSize, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 11);
+    std::mt19937 rng(23);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    std::normal_distribution<double> jitter(0.0, 2e-4);
+    std::vector<std::vector<Update>> windows(batches);
+    for (auto& window : windows) {
+        for (size_t i = 0; i < batchSize; ++i) {
+            Driver moved = drivers[pick(rng)];
+            moved.lat += jitter(rng);
+            moved.lng += jitter(rng);
+            window.push_back({moved, UpdateKind::Upsert});
+        }
+    }
+
+    KDTree live;
+    live.build(drivers);
+    double copyMs = timeMs([&] { KDTree copy = live; });
+
+    using Clock = std::chrono::system_clock;
+    const Clock::time_point start{};
+    PersistentKDTree history;
+    history.build(drivers, start);
+    size_t builtNodes = history.arenaNodes();
+    double writeMs = timeMs([&] {
+        for (size_t i = 0; i < batches; ++i) history.applyBatch(windows[i], start + std::chrono::seconds(i + 1));
+    });
+    size_t grownNodes = history.arenaNodes() - builtNodes;
+
+    auto search = [&](const PersistentKDTree::Snapshot& snapshot) {
+        size_t found = 0;
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += snapshot.findNearestNeighbors(d.lat, d.lng, 5).size();
+        }
+        return found;
+    };
+    size_t found = 0;
+    double pastMs = timeMs([&] { found += search(history.at(start)); });
+    double headMs = timeMs([&] { found += search(history.current()); });
+
+    history.releaseBefore(start + std::chrono::seconds(batches));
+    size_t dropped = 0;
+    double compactMs = timeMs([&] { dropped = history.compact(); });
+
+    std::cout << "versions: n=" << count << " full copy " << copyMs << " ms"
+              << "; " << batches << " versions of " << batchSize << " moves " << writeMs << " ms"
+              << " (+" << grownNodes << " nodes)"
+              << "; " << queries << " x 5-NN oldest " << pastMs << " ms / head " << headMs << " ms"
+              << "; compact to 1 version " << compactMs << " ms (" << dropped << " nodes dropped)"
+              << " (" << found << " hits)" << std::endl;
+}
+
+// Records scanned answers at several points in a PersistentKDTree's history
+// of moves and removes, then checks at() against them after later writes,
+// after releasing the oldest versions and compacting, and through snapshots
+// held across the compaction. Returns false on any mismatch.
+bool historyMatches(size_t count, size_t batches, size_t batchSize, size_t queries) {
+    using Clock = std::chrono::system_clock;
+    const Clock::time_point start{};
+    std::vector<Driver> truth = randomDrivers(count, 40);
+    std::vector<uint8_t> present(count, 1);
+    std::vector<Query> riders = randomRiders(queries, 41);
+    PersistentKDTree history;
+    history.build(truth, start);
+
+    struct Checkpoint {
+        Clock::time_point when;
+        std::vector<std::vector<int>> answers;
+        PersistentKDTree::Snapshot held;
+    };
+    std::vector<Checkpoint> checkpoints;
+    std::mt19937 rng(42);
+    std::normal_distribution<double> jitter(0.0, 2e-4);
+    for (size_t i = 0; i < batches; ++i) {
+        std::vector<Update> window;
+        for (size_t j = 0; j < batchSize; ++j) {
+            Driver& d = truth[rng() % count];
+            bool removing = present[d.id] && rng() % 3 == 0;
+            d.lat += jitter(rng);
+            d.lng += jitter(rng);
+            present[d.id] = !removing;
+            window.push_back({d, removing ? UpdateKind::Remove : UpdateKind::Upsert});
+        }
+        Clock::time_point when = start + std::chrono::seconds(i + 1);
+        history.applyBatch(window, when);
+        if (i % (batches / 6) != 0) continue;
+        Checkpoint& checkpoint = checkpoints.emplace_back();
+        checkpoint.when = when;
+        for (const Query& rider : riders) {
+            checkpoint.answers.push_back(scanNearest(truth, rider.lat, rider.lng, 5,
+                                                     [&](const Driver& d) { return present[d.id] && d.available; }));
+        }
+        checkpoint.held = history.current();
+    }
+
+    auto matches = [&](const PersistentKDTree::Snapshot& snapshot, const Checkpoint& checkpoint) {
+        size_t agree = 0;
+        for (size_t q = 0; q < riders.size(); ++q) {
+            std::vector<Driver> found = snapshot.findNearestNeighbors(riders[q].lat, riders[q].lng, 5);
+            const std::vector<int>& expected = checkpoint.answers[q];
+            bool match = found.size() == expected.size();
+            for (size_t j = 0; match && j < expected.size(); ++j) match = found[j].id == expected[j];
+            agree += match;
+        }
+        return agree == riders.size();
+    };
+
+    size_t total = 0;
+    size_t agreed = 0;
+    for (const Checkpoint& checkpoint : checkpoints) {
+        total += 2;
+        agreed += matches(history.at(checkpoint.when + std::chrono::milliseconds(500)), checkpoint);
+        agreed += matches(checkpoint.held, checkpoint);
+    }
+    // Keep the newer half; held snapshots of the older half must survive compaction
+    size_t released = checkpoints.size() / 2;
+    history.releaseBefore(checkpoints[released].when);
+    size_t before = history.arenaNodes();
+    history.compact();
+    size_t after = history.arenaNodes();
+    for (size_t i = 0; i < checkpoints.size(); ++i) {
+        total += 1 + (i >= released);
+        agreed += matches(checkpoints[i].held, checkpoints[i]);
+        if (i >= released) agreed += matches(history.at(checkpoints[i].when), checkpoints[i]);
+    }
+    // The compacted head answers like the live drivers
+    total += 1;
+    Checkpoint now;
+    for (const Query& rider : riders) {
+        now.answers.push_back(scanNearest(truth, rider.lat, rider.lng, 5,
+                                          [&](const Driver& d) { return present[d.id] && d.available; }));
+    }
+    agreed += matches(history.current(), now);
+
+    bool passed = agreed == total;
+    std::cout << "  history: " << agreed << "/" << total << " point-in-time checks match a scan"
+              << "; compact kept " << after << " of " << before << " nodes" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Returns false if, once writes stop and a swap has caught up, the front
+// buffer answers differently from a tree built off the store's snapshot
+bool doubleBuffered(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 12);
+    DriverStore store;
+    for (const Driver& d : drivers) store.upsert(d);
+
+    DoubleBufferConfig config;
+    config.rebuildInterval = std::chrono::milliseconds(200);
+    DoubleBufferedIndex index(store, config);
+
+    // Keep the store moving while queries run against the front buffer
+    std::atomic<bool> stop{false};
+    std::thread writer([&] {
+        std::mt19937 rng(29);
+        std::uniform_int_distribution<size_t> pick(0, count - 1);
+        while (!stop.load(std::memory_order_relaxed)) {
+            Driver moved = drivers[pick(rng)];
+            moved.lat += 1e-4;
+            store.upsert(moved);
+        }
+    });
+
+    size_t found = 0;
+    double searchMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += index.findNearestNeighbors(d.lat, d.lng, 5).size();
+        }
+    });
+    stop = true;
+    writer.join();
+
+    DoubleBufferStats stats = index.metrics();
+
+    index.rebuildNow();
+    uint64_t revision = 0;
+    KDTree fromStore;
+    fromStore.build(store.snapshot(&revision), NodeLayout::VanEmdeBoas);
+    std::vector<Query> riders = randomRiders(queries / 10, 39);
+    size_t agree = agreeingQueries(index, fromStore, riders, 5);
+    bool passed = index.metrics().pendingWrites == 0 && revision == store.version() &&
+                  index.size() == fromStore.size() && agree == riders.size();
+
+    std::cout << "double buffer: n=" << count << ", " << queries << " x 5-NN " << searchMs << " ms"
+              << "; " << stats.swaps << " swaps, last build " << stats.lastBuildMs << " ms"
+              << ", drain " << stats.lastDrainMs << " ms"
+              << ", staleness " << stats.stalenessMs << " ms"
+              << " (" << stats.pendingWrites << " writes pending)"
+              << " (" << found << " hits); after a swap " << agree << "/" << riders.size()
+              << " match the store snapshot" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Returns false if the allocation-free overloads allocated
+bool allocations(size_t count, size_t queries) {
+#ifdef KDTREE_COUNT_ALLOCATIONS
+    std::vector<Driver> drivers = randomDrivers(count, 13);
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+
+    std::array<Neighbor, 5> nearest;
+    std::array<Neighbor, 64> nearby;
+    auto counted = [&](auto&& fn) {
+        size_t before = allocation_counter::calls.load();
+        double ms = timeMs(fn);
+        return std::make_pair(allocation_counter::calls.load() - before, ms);
+    };
+
+    size_t found = 0;
+    auto [spanAllocs, spanMs] = counted([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += tree.findNearestNeighbors(d.lat, d.lng, std::span<Neighbor>(nearest));
+            found += tree.findWithinRadius(d.lat, d.lng, 0.0005, std::span<Neighbor>(nearby));
+        }
+    });
+    // Warm the context once so its first block exists, then it must stay quiet
+    QueryContext context;
+    auto contextQueries = [&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            context.reset();
+            found += tree.findNearestNeighbors(d.lat, d.lng, 5, context).size();
+            found += tree.findWithinRadius(d.lat, d.lng, 0.0005, context).size();
+        }
+    };
+    contextQueries();
+    auto [contextAllocs, contextMs] = counted(contextQueries);
+    auto [vectorAllocs, vectorMs] = counted([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += tree.findNearestNeighbors(d.lat, d.lng, 5).size();
+            found += tree.findWithinRadius(d.lat, d.lng, 0.0005).size();
+        }
+    });
+
+    std::cout << "allocs: n=" << count << ", " << queries << " x (5-NN + radius)"
+              << " span " << spanMs << " ms / " << spanAllocs << " allocations"
+              << ", context " << contextMs << " ms / " << contextAllocs << " allocations"
+              << ", vector " << vectorMs << " ms / " << vectorAllocs << " allocations"
+              << " (" << found << " hits)" << (spanAllocs == 0 && contextAllocs == 0 ? "" : " FAILED") << std::endl;
+    return spanAllocs == 0 && contextAllocs == 0;
+#else
+    (void)count;
+    (void)queries;
+    std::cout << "allocs: build with -DKDTREE_COUNT_ALLOCATIONS to count heap allocations" << std::endl;
+    return true;
+#endif
+}
+
+// Returns false if a wrapper's context overload disagrees with its vector
+// overload, or (counting allocations) allocates once its context is warm.
+// Cache lookups run twice so the timed round is served from the cache.
+bool contextWrappers(size_t count, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 33);
+    Geofence lot({{40.655, -73.800}, {40.655, -73.770}, {40.640, -73.770}, {40.640, -73.800}});
+    ZoneQueueIndex zones({lot});
+    zones.build(drivers);
+    HeatmapIndex heat;
+    heat.build(drivers);
+    CachedKDTree cached;
+    cached.build(drivers);
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<RatedDriver> rated(count);
+    for (size_t i = 0; i < count; ++i) rated[i] = {drivers[i], 3.5f + (i % 16) * 0.1f, now - std::chrono::seconds(i % 1800)};
+    ScoredShard scoredShard;
+    scoredShard.build(rated);
+
+    // Every fourth rider stands in the lot, where the queue answers
+    std::vector<Query> riders;
+    for (size_t i = 0; i < queries; ++i) {
+        const Driver& d = drivers[(i * 7919) % count];
+        riders.push_back(i % 4 ? Query{d.lat, d.lng} : Query{40.640 + (i % 15) * 0.001, -73.800 + (i % 30) * 0.001});
+    }
+    auto sameIds = [](const auto& vectorResult, const auto& spanResult, auto id) {
+        if (vectorResult.size() != spanResult.size()) return false;
+        for (size_t j = 0; j < spanResult.size(); ++j) {
+            if (id(vectorResult[j]) != spanResult[j].id) return false;
+        }
+        return true;
+    };
+    auto driverId = [](const Driver& d) { return d.id; };
+
+    QueryContext context;
+    size_t agree = 0;
+    for (const Query& rider : riders) {
+        context.reset();
+        bool same = sameIds(zones.findNearestNeighbors(rider.lat, rider.lng, 5),
+                            zones.findNearestNeighbors(rider.lat, rider.lng, 5, context), driverId);
+        same &= sameIds(heat.findNearestNeighbors(rider.lat, rider.lng, 5),
+                        heat.findNearestNeighbors(rider.lat, rider.lng, 5, context), driverId);
+        same &= sameIds(cached.findNearestNeighbors(rider.lat, rider.lng, 5),
+                        cached.findNearestNeighbors(rider.lat, rider.lng, 5, context), driverId);
+        std::vector<ScoredDriver> best = scoredShard.findBestScored(rider.lat, rider.lng, 5, now);
+        std::span<ScoredDriver> bestInContext = scoredShard.findBestScored(rider.lat, rider.lng, 5, context, now);
+        same &= best.size() == bestInContext.size();
+        for (size_t j = 0; same && j < best.size(); ++j) same = best[j].driver.id == bestInContext[j].driver.id;
+        agree += same;
+    }
+    std::vector<Query> batch(riders.begin(), riders.begin() + std::min<size_t>(riders.size(), 1000));
+    context.reset();
+    std::vector<std::vector<Driver>> within = tree.findWithinRadiusBatch(batch, 0.001);
+    std::span<const std::span<Neighbor>> withinInContext = tree.findWithinRadiusBatch(batch, 0.001, context);
+    size_t batchAgree = 0;
+    for (size_t i = 0; i < batch.size(); ++i) {
+        std::vector<int> expected;
+        std::vector<int> actual;
+        for (const Driver& d : within[i]) expected.push_back(d.id);
+        for (const Neighbor& n : withinInContext[i]) actual.push_back(n.id);
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        batchAgree += expected == actual;
+    }
+    bool passed = agree == riders.size() && batchAgree == batch.size();
+
+    std::string allocs = "allocations not counted";
+#ifdef KDTREE_COUNT_ALLOCATIONS
+    size_t before = allocation_counter::calls.load();
+    size_t found = 0;
+    for (const Query& rider : riders) {
+        context.reset();
+        found += zones.findNearestNeighbors(rider.lat, rider.lng, 5, context).size();
+        found += heat.findNearestNeighbors(rider.lat, rider.lng, 5, context).size();
+        found += cached.findNearestNeighbors(rider.lat, rider.lng, 5, context).size();
+        found += scoredShard.findBestScored(rider.lat, rider.lng, 5, context, now).size();
+    }
+    context.reset();
+    found += tree.findWithinRadiusBatch(batch, 0.001, context).size();
+    size_t allocated = allocation_counter::calls.load() - before;
+    passed &= allocated == 0;
+    allocs = std::to_string(allocated) + " allocations warm (" + std::to_string(found) + " hits)";
+#endif
+    std::cout << "context wrappers: zone queue, heatmap, result cache, scored " << agree << "/" << riders.size()
+              << " agree, radius batch " << batchAgree << "/" << batch.size() << "; " << allocs
+              << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Feeds the same moves and removes to a DeltaIndex merging in the background
+// and to a plain KDTree, comparing answers between chunks while merges are
+// still running, then rebuilds the index in the middle of a merge. Returns
+// false on any disagreement.
+bool deltaMatchesTree(size_t count, size_t writes, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 33);
+    std::vector<Query> riders = randomRiders(queries, 34);
+    ThreadPool workers(ThreadPoolConfig{1, false, 256});
+    DeltaIndex index(count / 100, &workers);
+    index.build(drivers);
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+
+    std::mt19937 rng(35);
+    std::normal_distribution<double> jitter(0.0, 2e-4);
+    size_t checks = 0;
+    size_t agreed = 0;
+    for (size_t i = 1; i <= writes; ++i) {
+        Driver& d = drivers[rng() % count];
+        if (i % 10 == 0) {
+            index.remove(d.id);
+            tree.remove(d);
+        } else {
+            d.lat += jitter(rng);
+            d.lng += jitter(rng);
+            index.upsert(d);
+            tree.update(d);
+        }
+        if (i % (writes / 20) == 0) {
+            ++checks;
+            agreed += agreeingQueries(index, tree, riders, 5) == riders.size();
+        }
+    }
+    index.waitForMerge();
+    ++checks;
+    agreed += agreeingQueries(index, tree, riders, 5) == riders.size();
+
+    // Start a merge and replace the index while it runs
+    for (size_t i = 0; i < count / 100; ++i) index.upsert(drivers[i]);
+    std::vector<Driver> fresh = randomDrivers(count / 10, 36);
+    index.build(fresh);
+    index.waitForMerge();
+    KDTree freshTree;
+    freshTree.build(fresh, NodeLayout::VanEmdeBoas);
+    bool rebuilt = agreeingQueries(index, freshTree, riders, 5) == riders.size();
+
+    bool passed = agreed == checks && rebuilt;
+    std::cout << "  delta vs tree: " << agreed << "/" << checks << " checkpoints identical over " << writes
+              << " writes; build during a merge " << (rebuilt ? "kept" : "lost") << " the new base"
+              << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+void logStructured(size_t count, size_t writes, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 9);
+    std::mt19937 rng(19);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    std::normal_distribution<double> jitter(0.0, 2e-4);
+    std::vector<Driver> moves;
+    for (size_t i = 0; i < writes; ++i) {
+        Driver moved = drivers[pick(rng)];
+        moved.lat += jitter(rng);
+        moved.lng += jitter(rng);
+        moves.push_back(moved);
+    }
+
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+    double treeWriteMs = timeMs([&] { for (const Driver& d : moves) tree.update(d); });
+    size_t found = 0;
+    double treeReadMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += tree.findNearestNeighbors(d.lat, d.lng, 5).size();
+        }
+    });
+
+    ThreadPool workers(ThreadPoolConfig{1, false, 256});
+    DeltaIndex index(writes + 1, &workers);
+    index.build(drivers);
+    double deltaWriteMs = timeMs([&] { for (const Driver& d : moves) index.upsert(d); });
+    index.waitForMerge();
+    double deltaReadMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[(i * 7919) % count];
+            found += index.findNearestNeighbors(d.lat, d.lng, 5).size();
+        }
+    });
+
+    std::cout << "lsm: n=" << count << ", " << writes << " writes"
+              << " tree " << treeWriteMs << " ms / delta " << deltaWriteMs << " ms"
+              << "; " << queries << " x 5-NN with " << index.deltaSize() << " in delta"
+              << " tree " << treeReadMs << " ms / delta " << deltaReadMs << " ms"
+              << " (" << found << " hits)" << std::endl;
+}
+
+// Riders refreshing from nearly the same spot while drivers keep moving:
+// each tick moves `movesPerTick` drivers and refreshes every rider once.
+// Every answer the cache serves must match the plain tree's exactly, and so
+// must a cache small enough to keep evicting
+bool resultCached(size_t count, size_t riders, size_t ticks, size_t movesPerTick) {
+    std::vector<Driver> drivers = randomDrivers(count, 31);
+    std::mt19937 rng(37);
+    std::uniform_int_distribution<size_t> pick(0, count - 1);
+    std::normal_distribution<double> drift(0.0, 5e-4);
+    std::normal_distribution<double> fidget(0.0, 3e-5);
+    std::vector<Query> homes;
+    for (size_t i = 0; i < riders; ++i) homes.push_back({drivers[pick(rng)].lat, drivers[pick(rng)].lng});
+
+    std::vector<std::vector<Driver>> moves(ticks);
+    std::vector<std::vector<Query>> refreshes(ticks);
+    for (size_t t = 0; t < ticks; ++t) {
+        for (size_t i = 0; i < movesPerTick; ++i) {
+            Driver& d = drivers[pick(rng)];
+            d.lat += drift(rng);
+            d.lng += drift(rng);
+            moves[t].push_back(d);
+        }
+        for (const Query& home : homes) refreshes[t].push_back({home.lat + fidget(rng), home.lng + fidget(rng)});
+    }
+
+    std::vector<Driver> initial = randomDrivers(count, 31);
+    KDTree plain;
+    plain.build(initial, NodeLayout::VanEmdeBoas);
+    CachedKDTree cached;
+    cached.build(initial);
+    CachedKDTree small(ResultCacheConfig{.capacity = 256});
+    small.build(initial);
+    size_t found = 0;
+    double plainMs = timeMs([&] {
+        for (size_t t = 0; t < ticks; ++t) {
+            for (const Driver& d : moves[t]) plain.update(d);
+            for (const Query& rider : refreshes[t]) found += plain.findNearestNeighbors(rider.lat, rider.lng, 5).size();
+        }
+    });
+    double cachedMs = timeMs([&] {
+        for (size_t t = 0; t < ticks; ++t) {
+            for (const Driver& d : moves[t]) cached.update(d);
+            for (const Query& rider : refreshes[t]) found += cached.findNearestNeighbors(rider.lat, rider.lng, 5).size();
+        }
+    });
+
+    // Replay the moves into the small cache too, then ask from every rider's
+    // last spot twice so the second round is served from the caches
+    for (size_t t = 0; t < ticks; ++t) {
+        for (const Driver& d : moves[t]) small.update(d);
+    }
+    auto ids = [](const std::vector<Driver>& result) {
+        std::vector<int> out;
+        for (const Driver& d : result) out.push_back(d.id);
+        return out;
+    };
+    size_t same = 0;
+    size_t smallSame = 0;
+    for (size_t round = 0; round < 2; ++round) {
+        for (const Query& rider : refreshes.back()) {
+            std::vector<int> fresh = ids(plain.findNearestNeighbors(rider.lat, rider.lng, 5));
+            same += ids(cached.findNearestNeighbors(rider.lat, rider.lng, 5)) == fresh;
+            smallSame += ids(small.findNearestNeighbors(rider.lat, rider.lng, 5)) == fresh;
+        }
+    }
+    bool passed = same == 2 * riders && smallSame == 2 * riders && small.stats().evictions > 0;
+
+    ResultCacheStats stats = cached.stats();
+    double lookups = static_cast<double>(stats.hits + stats.misses);
+    std::cout << "result cache: n=" << count << ", " << riders << " riders x " << ticks << " ticks, "
+              << movesPerTick << " moves per tick"
+              << "; plain " << plainMs << " ms / cached " << cachedMs << " ms"
+              << ", hit ratio " << (lookups > 0 ? stats.hits / lookups : 0.0)
+              << ", " << stats.unproven << " unproven, " << stats.invalidated << " invalidated, " << stats.expired << " expired"
+              << "; same five drivers " << same << "/" << 2 * riders
+              << ", capacity 256 " << smallSame << "/" << 2 * riders << " with "
+              << small.stats().evictions << " evictions"
+              << " (" << found << " hits)" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// What a caller does without a fenced search: ask for more and more
+// neighbours until k of them pass the fence
+std::vector<Driver> fencedByFiltering(const KDTree& tree, double lat, double lng, int k,
+                                      const Geofence& fence, FenceMode mode) {
+    for (int ask = k;; ask *= 2) {
+        std::vector<Driver> candidates = tree.findNearestNeighbors(lat, lng, ask);
+        std::vector<Driver> kept;
+        for (const Driver& d : candidates) {
+            if (fence.contains(d.lat, d.lng) == (mode == FenceMode::Inside)) kept.push_back(d);
+            if (kept.size() == static_cast<size_t>(k)) return kept;
+        }
+        if (candidates.size() < static_cast<size_t>(ask)) return kept;
+    }
+}
+
+// Returns false if the fenced search disagrees with filtering first and
+// scanning, or with growing k and filtering
+bool fenced(size_t count, size_t checked, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 15);
+    KDTree tree;
+    tree.build(drivers, NodeLayout::VanEmdeBoas);
+
+    // A concave pickup lot shaped round the terminals, and a no-pickup zone
+    Geofence lot({{40.655, -73.800}, {40.655, -73.770}, {40.640, -73.770}, {40.640, -73.780},
+                  {40.648, -73.780}, {40.648, -73.790}, {40.640, -73.790}, {40.640, -73.800}});
+    Geofence restricted({{40.750, -73.995}, {40.765, -73.975}, {40.780, -73.960},
+                         {40.768, -73.950}, {40.750, -73.970}, {40.740, -73.985}});
+
+    std::mt19937 rng(16);
+    // Riders within a kilometre or so; further out, growing k gets hopeless
+    std::uniform_real_distribution<double> around(-0.01, 0.01);
+    std::vector<Query> atAirport(queries);
+    for (Query& q : atAirport) q = {40.648 + around(rng), -73.785 + around(rng)};
+    std::vector<Query> inTown(queries);
+    for (Query& q : inTown) q = {40.760 + around(rng), -73.972 + around(rng)};
+
+    bool ok = true;
+    auto compare = [&](const char* label, const std::vector<Query>& riders, const Geofence& fence, FenceMode mode) {
+        size_t found = 0;
+        size_t same = 0;
+        size_t scanned = 0;
+        std::vector<std::vector<Driver>> pruned(riders.size());
+        std::vector<std::vector<Driver>> filtered(riders.size());
+        double prunedMs = timeMs([&] {
+            for (size_t i = 0; i < riders.size(); ++i) pruned[i] = tree.findNearestNeighbors(riders[i].lat, riders[i].lng, 5, fence, mode);
+        });
+        double filteredMs = timeMs([&] {
+            for (size_t i = 0; i < riders.size(); ++i) filtered[i] = fencedByFiltering(tree, riders[i].lat, riders[i].lng, 5, fence, mode);
+        });
+        for (size_t i = 0; i < riders.size(); ++i) {
+            found += pruned[i].size();
+            bool match = pruned[i].size() == filtered[i].size();
+            for (size_t j = 0; match && j < pruned[i].size(); ++j) match = pruned[i][j].id == filtered[i][j].id;
+            same += match;
+        }
+        auto passes = [&](const Driver& d) { return fence.contains(d.lat, d.lng) == (mode == FenceMode::Inside); };
+        for (size_t i = 0; i < checked; ++i) {
+            std::vector<int> truth = scanNearest(drivers, riders[i].lat, riders[i].lng, 5, passes);
+            bool match = pruned[i].size() == truth.size();
+            for (size_t j = 0; match && j < truth.size(); ++j) match = pruned[i][j].id == truth[j];
+            scanned += match;
+        }
+        bool passed = same == riders.size() && scanned == checked;
+        ok &= passed;
+        std::cout << "  " << label << ": fenced " << prunedMs << " ms / grow-and-filter " << filteredMs << " ms"
+                  << ", " << same << "/" << riders.size() << " identical, " << scanned << "/" << checked
+                  << " match filter-then-scan (" << found << " hits)" << (passed ? "" : " FAILED") << std::endl;
+    };
+
+    std::cout << "geofence: n=" << count << ", " << queries << " x 5-NN per case" << std::endl;
+    compare("inside airport lot", atAirport, lot, FenceMode::Inside);
+    compare("outside restricted zone", inTown, restricted, FenceMode::Outside);
+    return ok;
+}
+
+// Returns false if batched writes queue differently from single updates, or
+// a dispatched driver pinging from the lot joins the queue again
+bool airportQueues(size_t count, size_t moves, size_t dispatches) {
+    std::vector<Driver> drivers = randomDrivers(count, 17);
+    Geofence lot({{40.655, -73.800}, {40.655, -73.770}, {40.640, -73.770}, {40.640, -73.780},
+                  {40.648, -73.780}, {40.648, -73.790}, {40.640, -73.790}, {40.640, -73.800}});
+    KDTree plain;
+    plain.build(drivers, NodeLayout::VanEmdeBoas);
+    ZoneQueueIndex index({lot});
+    index.build(drivers);
+    size_t initial = index.queueLength(0);
+
+    // A tenth of the moves drive into the lot, the rest wander about town
+    std::mt19937 rng(18);
+    std::uniform_real_distribution<double> lotLat(40.640, 40.655);
+    std::uniform_real_distribution<double> lotLng(-73.800, -73.770);
+    std::uniform_real_distribution<double> jitter(-0.001, 0.001);
+    std::vector<Driver> moved;
+    moved.reserve(moves);
+    for (size_t i = 0; i < moves; ++i) {
+        Driver d = drivers[rng() % count];
+        if (i % 10 == 0) {
+            d.lat = lotLat(rng);
+            d.lng = lotLng(rng);
+        } else {
+            d.lat += jitter(rng);
+            d.lng += jitter(rng);
+        }
+        moved.push_back(d);
+    }
+    double plainMs = timeMs([&] { for (const Driver& d : moved) plain.update(d); });
+    double zonedMs = timeMs([&] { for (const Driver& d : moved) index.update(d); });
+    size_t queued = index.queueLength(0);
+
+    ZoneQueueIndex batched({lot});
+    batched.build(drivers);
+    std::vector<Update> changes;
+    changes.reserve(moves);
+    for (const Driver& d : moved) changes.push_back({d, UpdateKind::Upsert});
+    double batchedMs = timeMs([&] { batched.applyBatch(changes); });
+    std::vector<Driver> singleOrder = index.queued(0, queued);
+    std::vector<Driver> batchOrder = batched.queued(0, queued + 1);
+    bool sameQueue = singleOrder.size() == batchOrder.size();
+    for (size_t i = 0; sameQueue && i < singleOrder.size(); ++i) sameQueue = singleOrder[i].id == batchOrder[i].id;
+
+    // Dispatch from the head and cancel a driver now and then
+    size_t dispatched = 0;
+    size_t cancelled = 0;
+    std::vector<Driver> takenOff;
+    double queueMs = timeMs([&] {
+        for (size_t i = 0; i < dispatches; ++i) {
+            if (std::optional<Driver> head = index.dequeue(0)) {
+                ++dispatched;
+                takenOff.push_back(*head);
+            }
+            cancelled += index.cancel(moved[(i * 7919) % moves].id);
+        }
+    });
+
+    // Still parked in the lot, the dispatched drivers keep pinging
+    size_t remaining = index.queueLength(0);
+    for (const Driver& d : takenOff) index.update(d);
+    bool heldOut = index.queueLength(0) == remaining;
+
+    size_t found = 0;
+    double riderMs = timeMs([&] {
+        for (size_t i = 0; i < dispatches; ++i) found += index.findNearestNeighbors(40.650, -73.795, 3).size();
+    });
+
+    bool passed = sameQueue && heldOut;
+    std::cout << "airport queues: n=" << count << ", " << initial << " queued at build; "
+              << moves << " updates plain " << plainMs << " ms / zoned " << zonedMs << " ms"
+              << " / batched " << batchedMs << " ms, " << queued << " queued"
+              << (sameQueue ? "" : " (batched queue differs)") << "; "
+              << dispatched << " dequeues + " << cancelled << " cancels in " << queueMs << " ms"
+              << (heldOut ? "" : " (dispatched drivers re-queued)") << "; "
+              << dispatches << " lot riders " << riderMs << " ms"
+              << " (" << found << " hits)" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Returns false unless every level of the snapshot holds exactly the cells
+// and counts a scan of the drivers gives
+bool heatmap(size_t count, size_t moves, size_t windows) {
+    std::vector<Driver> drivers = randomDrivers(count, 19);
+    KDTree plain;
+    plain.build(drivers, NodeLayout::VanEmdeBoas);
+    HeatmapIndex index;
+    index.build(drivers);
+
+    // A second's worth of GPS pings per window, one in twenty also
+    // flipping availability
+    std::mt19937 rng(20);
+    std::uniform_real_distribution<double> jitter(-0.0005, 0.0005);
+    std::vector<std::vector<Update>> batches(windows);
+    for (auto& batch : batches) {
+        batch.reserve(moves);
+        for (size_t i = 0; i < moves; ++i) {
+            Driver& d = drivers[rng() % count];
+            d.lat += jitter(rng);
+            d.lng += jitter(rng);
+            if (i % 20 == 0) d.available = !d.available;
+            batch.push_back({d, UpdateKind::Upsert});
+        }
+    }
+    double plainMs = timeMs([&] { for (const auto& batch : batches) plain.applyBatch(batch); });
+    double trackedMs = timeMs([&] { for (const auto& batch : batches) index.applyBatch(batch); });
+
+    HeatmapSnapshot snapshot;
+    double exportMs = timeMs([&] { snapshot = index.snapshot(); });
+    // The same counts gathered the hard way: finest cells from a driver
+    // scan, each coarser level by halving the row and column
+    size_t levels = snapshot.levels.size();
+    std::vector<std::unordered_map<uint64_t, uint32_t>> recount(levels);
+    double scanMs = timeMs([&] {
+        for (const Driver& d : plain.snapshot()) {
+            if (!d.available) continue;
+            auto row = static_cast<uint64_t>((d.lat + 90.0) / snapshot.cellDegrees[0]);
+            auto col = static_cast<uint64_t>((d.lng + 180.0) / snapshot.cellDegrees[0]);
+            for (size_t level = 0; level < levels; ++level) ++recount[level][((row >> level) << 32) | (col >> level)];
+        }
+    });
+    // Each snapshot cell must match its recount, and there must be exactly as
+    // many snapshot cells as recounted ones, so none are missing or extra
+    bool passed = true;
+    std::string agreement;
+    for (size_t level = 0; level < levels; ++level) {
+        size_t agree = 0;
+        for (const HeatCell& cell : snapshot.levels[level]) {
+            auto found = recount[level].find((static_cast<uint64_t>(cell.row) << 32) | cell.col);
+            agree += found != recount[level].end() && found->second == cell.count;
+        }
+        passed &= agree == recount[level].size() && snapshot.levels[level].size() == recount[level].size();
+        agreement += (level ? " " : "") + std::to_string(agree) + "/" + std::to_string(recount[level].size());
+    }
+
+    std::cout << "heatmap: n=" << count << ", " << windows << " windows x " << moves << " updates;"
+              << " plain " << plainMs << " ms / counted " << trackedMs << " ms;"
+              << " snapshot of " << snapshot.levels[0].size() << "+" << snapshot.levels[1].size()
+              << "+" << snapshot.levels[2].size() << "+" << snapshot.levels[3].size() << " cells "
+              << exportMs << " ms vs driver scan " << scanMs << " ms"
+              << " (cells agree per level, finest first: " << agreement << ")" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+void density(size_t count, size_t movesPerSecond, size_t seconds) {
+    std::vector<Driver> drivers = randomDrivers(count, 21);
+    SupplyDensity grid(40.55, -74.15, 40.90, -73.70);
+    auto start = SupplyDensity::Clock::now();
+    double rebuildMs = timeMs([&] { grid.rebuild(drivers, start); });
+
+    std::mt19937 rng(22);
+    std::uniform_real_distribution<double> jitter(-0.0005, 0.0005);
+    double tickMs = 0;
+    double exportMs = 0;
+    std::vector<float> cells;
+    for (size_t second = 1; second <= seconds; ++second) {
+        auto now = start + std::chrono::seconds(second);
+        tickMs += timeMs([&] {
+            for (size_t i = 0; i < movesPerSecond; ++i) {
+                Driver& d = drivers[rng() % count];
+                d.lat += jitter(rng);
+                d.lng += jitter(rng);
+                grid.observe(d, now);
+            }
+        });
+        exportMs += timeMs([&] { cells = grid.snapshot(now); });
+    }
+    double total = 0;
+    for (float cell : cells) total += cell;
+
+    std::cout << "density: n=" << count << ", " << grid.rowCount() << "x" << grid.columnCount() << " cells;"
+              << " rebuild " << rebuildMs << " ms; " << movesPerSecond << " moves/s incremental "
+              << tickMs / seconds << " ms/s, export " << exportMs / seconds << " ms"
+              << " (mean cell " << total / cells.size() << ")" << std::endl;
+}
+
+// Drives a grid through rebuild, moves, availability flips and forgets over
+// 40 half-lives, past the point where the epoch rescales, and compares every
+// cell against the kernel recomputed from each driver's last sighting.
+// Returns the number of cells off by more than float rounding.
+size_t densityMismatches(double south, double west, double north, double east, size_t count, size_t ticks) {
+    using Clock = SupplyDensity::Clock;
+    DensityConfig config;
+    SupplyDensity grid(south, west, north, east, config);
+    double width = east - west;
+    if (width < 0) width += 360.0;
+
+    std::mt19937 rng(29);
+    std::uniform_real_distribution<double> lat(south, north);
+    std::uniform_real_distribution<double> offset(0.0, width);
+    std::vector<Driver> drivers;
+    for (size_t i = 0; i < count; ++i) {
+        drivers.push_back({static_cast<int>(i), lat(rng), std::remainder(west + offset(rng), 360.0), "driver", i % 10 != 0});
+    }
+    std::vector<Clock::time_point> seenAt(count);
+    std::vector<uint8_t> tracked(count);
+    auto start = Clock::now();
+    grid.rebuild(drivers, start);
+    for (size_t i = 0; i < count; ++i) {
+        seenAt[i] = start;
+        tracked[i] = drivers[i].available;
+    }
+
+    double inverse = 1.0 / (config.radiusMetres * config.radiusMetres);
+    double halfLifeSeconds = std::chrono::duration<double>(config.halfLife).count();
+    const LocalProjection& frame = grid.projection();
+    auto mismatches = [&](Clock::time_point now) {
+        std::vector<float> cells = grid.snapshot(now);
+        std::vector<LocalPoint> points(count);
+        std::vector<double> weights(count);
+        for (size_t i = 0; i < count; ++i) {
+            points[i] = frame.toLocal(drivers[i].lat, drivers[i].lng);
+            weights[i] = tracked[i] ? std::exp2(-std::chrono::duration<double>(now - seenAt[i]).count() / halfLifeSeconds) : 0.0;
+        }
+        size_t wrong = 0;
+        for (size_t row = 0; row < grid.rowCount(); ++row) {
+            for (size_t col = 0; col < grid.columnCount(); ++col) {
+                auto [cellLat, cellLng] = grid.cellCentre(row, col);
+                LocalPoint centre = frame.toLocal(cellLat, cellLng);
+                double expected = 0.0;
+                for (size_t i = 0; i < count; ++i) {
+                    double dx = points[i].x - centre.x;
+                    double dy = points[i].y - centre.y;
+                    expected += weights[i] * std::max(0.0, 1.0 - (dx * dx + dy * dy) * inverse);
+                }
+                double actual = cells[row * grid.columnCount() + col];
+                wrong += std::abs(actual - expected) > 1e-3 + 1e-4 * expected;
+            }
+        }
+        return wrong;
+    };
+
+    size_t wrong = mismatches(start);
+    std::uniform_real_distribution<double> jitter(-0.002, 0.002);
+    auto tick = std::chrono::duration_cast<Clock::duration>(config.halfLife * 40 / static_cast<int>(ticks));
+    for (size_t t = 1; t <= ticks; ++t) {
+        auto now = start + tick * static_cast<int>(t);
+        for (size_t i = 0; i < count / 10; ++i) {
+            size_t pick = rng() % count;
+            Driver& d = drivers[pick];
+            if (i % 25 == 0) {
+                grid.forget(d.id);
+                tracked[pick] = 0;
+                continue;
+            }
+            d.lat += jitter(rng);
+            d.lng = std::remainder(d.lng + jitter(rng), 360.0);
+            if (i % 7 == 0) d.available = !d.available;
+            grid.observe(d, now);
+            seenAt[pick] = now;
+            tracked[pick] = d.available;
+        }
+        if (t % 5 == 0 || t == ticks) wrong += mismatches(now);
+    }
+    return wrong;
+}
+
+// Returns false unless the density grid matches a brute-force recompute,
+// over a metro and over one straddling the antimeridian
+bool densityMatchesScan(size_t count, size_t ticks) {
+    size_t metro = densityMismatches(40.70, -74.05, 40.80, -73.93, count, ticks);
+    size_t fiji = densityMismatches(-18.20, 179.90, -18.05, -179.95, count, ticks);
+    bool passed = metro == 0 && fiji == 0;
+    std::cout << "density recompute: " << count << " drivers, " << ticks << " ticks over 40 half-lives;"
+              << " cells off " << metro << " in a metro, " << fiji << " across the antimeridian"
+              << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Churns a tree through every write path, moving drivers between fleets
+// with and without moving them, and checks fleet-scoped search against a
+// scan after each round. Returns the number of mismatching queries.
+size_t fleetWrites(size_t count, size_t fleets, size_t rounds, size_t queries) {
+    std::vector<Driver> truth = randomDrivers(count, 27);
+    std::vector<uint8_t> present(count, 1);
+    std::mt19937 rng(28);
+    for (Driver& d : truth) d.fleet = static_cast<uint8_t>(rng() % fleets);
+    KDTree tree;
+    tree.build(truth, NodeLayout::VanEmdeBoas);
+
+    std::uniform_real_distribution<double> jitter(-0.001, 0.001);
+    size_t mismatches = 0;
+    for (size_t round = 0; round < rounds; ++round) {
+        std::vector<Update> batch;
+        for (size_t i = 0; i < count / 20; ++i) {
+            Driver& d = truth[rng() % count];
+            bool removing = false;
+            switch (rng() % 6) {
+            case 0:
+            case 1:
+                d.fleet = static_cast<uint8_t>(rng() % fleets);
+                break;
+            case 2:
+                d.lat += jitter(rng);
+                d.lng += jitter(rng);
+                d.fleet = static_cast<uint8_t>(rng() % fleets);
+                break;
+            case 3:
+                d.lat += jitter(rng);
+                d.lng += jitter(rng);
+                break;
+            case 4:
+                d.available = !d.available;
+                break;
+            default:
+                removing = present[d.id];
+                break;
+            }
+            present[d.id] = !removing;
+            batch.push_back({d, removing ? UpdateKind::Remove : UpdateKind::Upsert});
+        }
+        // Alternate rounds between applyBatch and one write at a time
+        if (round % 2 == 0) {
+            tree.applyBatch(batch);
+        } else {
+            for (const Update& change : batch) {
+                if (change.kind == UpdateKind::Remove) tree.remove(change.driver);
+                else tree.update(change.driver);
+            }
+        }
+        if (round % 3 == 2) tree.compact();
+
+        for (size_t q = 0; q < queries; ++q) {
+            const Driver& rider = truth[rng() % count];
+            FleetMask mask = q % 2 ? fleetBit(static_cast<uint8_t>(rng() % fleets)) : static_cast<FleetMask>(rng());
+            std::vector<int> expected = scanNearest(truth, rider.lat, rider.lng, 5, [&](const Driver& d) {
+                return present[d.id] && d.available && (fleetBit(d.fleet) & mask);
+            });
+            std::vector<Driver> found = tree.findNearestNeighbors(rider.lat, rider.lng, 5, mask);
+            bool match = found.size() == expected.size();
+            for (size_t j = 0; match && j < expected.size(); ++j) match = found[j].id == expected[j];
+            mismatches += !match;
+        }
+    }
+    return mismatches;
+}
+
+// Returns false if fleet-scoped search disagrees with a scan of the fleet,
+// or fleets are lost on the way through a DoubleBufferedIndex rebuild
+bool tenants(size_t count, size_t fleets, size_t queries) {
+    // Fleets of very different sizes: each one half the size of the last
+    std::vector<Driver> drivers = randomDrivers(count, 23);
+    std::mt19937 rng(24);
+    for (Driver& d : drivers) {
+        uint8_t fleet = 0;
+        while (fleet + 1u < fleets && rng() % 2) ++fleet;
+        d.fleet = fleet;
+    }
+
+    KDTree shared;
+    double sharedBuildMs = timeMs([&] { shared.build(drivers, NodeLayout::VanEmdeBoas); });
+    std::vector<KDTree> separate(fleets);
+    double separateBuildMs = timeMs([&] {
+        std::vector<std::vector<Driver>> byFleet(fleets);
+        for (const Driver& d : drivers) byFleet[d.fleet].push_back(d);
+        for (size_t f = 0; f < fleets; ++f) separate[f].build(std::move(byFleet[f]), NodeLayout::VanEmdeBoas);
+    });
+
+    bool ok = true;
+    std::cout << "tenants: n=" << count << ", " << fleets << " fleets; build shared " << sharedBuildMs
+              << " ms / separate " << separateBuildMs << " ms" << std::endl;
+    for (uint8_t fleet : {uint8_t{0}, static_cast<uint8_t>(fleets / 2), static_cast<uint8_t>(fleets - 1)}) {
+        size_t members = separate[fleet].size();
+        size_t agree = 0;
+        double sharedMs = 0;
+        double separateMs = 0;
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& rider = drivers[(i * 7919) % count];
+            std::vector<Driver> scoped;
+            std::vector<Driver> own;
+            sharedMs += timeMs([&] { scoped = shared.findNearestNeighbors(rider.lat, rider.lng, 5, fleetBit(fleet)); });
+            separateMs += timeMs([&] { own = separate[fleet].findNearestNeighbors(rider.lat, rider.lng, 5); });
+            bool match = scoped.size() == own.size();
+            for (size_t j = 0; match && j < own.size(); ++j) match = scoped[j].id == own[j].id;
+            agree += match;
+        }
+        size_t checked = queries / 1000;
+        size_t scanned = 0;
+        for (size_t i = 0; i < checked; ++i) {
+            const Driver& rider = drivers[(i * 104729) % count];
+            std::vector<int> expected = scanNearest(drivers, rider.lat, rider.lng, 5,
+                                                    [fleet](const Driver& d) { return d.fleet == fleet; });
+            std::vector<Driver> scoped = shared.findNearestNeighbors(rider.lat, rider.lng, 5, fleetBit(fleet));
+            bool match = scoped.size() == expected.size();
+            for (size_t j = 0; match && j < expected.size(); ++j) match = scoped[j].id == expected[j];
+            scanned += match;
+        }
+        bool passed = agree == queries && scanned == checked;
+        ok &= passed;
+        std::cout << "  fleet " << int(fleet) << " (" << members << " drivers): " << queries << " x 5-NN shared "
+                  << sharedMs << " ms / own tree " << separateMs << " ms, " << agree << " identical, "
+                  << scanned << "/" << checked << " match a scan" << (passed ? "" : " FAILED") << std::endl;
+    }
+
+    size_t churned = fleetWrites(20000, fleets, 12, 200);
+    ok &= churned == 0;
+    std::cout << "  every write path, 12 rounds x 200 masked 5-NN: " << churned << " mismatches"
+              << (churned == 0 ? "" : " FAILED") << std::endl;
+
+    // Fleets must survive the column store and a rebuild
+    DriverStore store;
+    for (const Driver& d : drivers) store.upsert(d);
+    size_t kept = 0;
+    for (const Driver& d : store.snapshot()) kept += d.fleet == drivers[d.id].fleet;
+    DoubleBufferedIndex buffered(store);
+    buffered.rebuildNow();
+    const Driver& rider = drivers.front();
+    uint8_t last = static_cast<uint8_t>(fleets - 1);
+    std::vector<Driver> fromBuffer = buffered.findNearestNeighbors(rider.lat, rider.lng, 5, fleetBit(last));
+    std::vector<Driver> fromShared = shared.findNearestNeighbors(rider.lat, rider.lng, 5, fleetBit(last));
+    bool sameBuffered = fromBuffer.size() == fromShared.size() && !fromShared.empty();
+    for (size_t j = 0; sameBuffered && j < fromShared.size(); ++j) sameBuffered = fromBuffer[j].id == fromShared[j].id;
+    bool stored = kept == count && sameBuffered;
+    ok &= stored;
+    std::cout << "  store round trip: " << kept << "/" << count << " fleets kept, double-buffered fleet "
+              << int(last) << " search " << (sameBuffered ? "matches" : "differs") << (stored ? "" : " FAILED") << std::endl;
+
+    // A fleet past the mask must be turned away by every write path, before
+    // it changes anything, rather than share a bit with a lower fleet
+    auto rejects = [](auto&& write) {
+        try {
+            write();
+        } catch (const std::invalid_argument&) {
+            return true;
+        }
+        return false;
+    };
+    Driver outside = drivers.front();
+    outside.id = static_cast<int>(count);
+    outside.fleet = kMaxFleets;
+    std::vector<Update> mixed = {{drivers[1], UpdateKind::Upsert}, {outside, UpdateKind::Upsert}};
+    size_t sizeBefore = shared.size();
+    size_t rejected = 0;
+    rejected += rejects([&] { Driver(0, 0.0, 0.0, "driver", true, kMaxFleets); });
+    rejected += rejects([&] { shared.insert(outside); });
+    rejected += rejects([&] { shared.applyBatch(mixed); });
+    rejected += rejects([&] { KDTree().build({outside}); });
+    rejected += rejects([&] { store.upsert(outside); });
+    bool guarded = rejected == 5 && shared.size() == sizeBefore && store.snapshot().size() == count;
+    ok &= guarded;
+    std::cout << "  fleet " << kMaxFleets << ": " << rejected << "/5 write paths reject it"
+              << (guarded ? "" : " FAILED") << std::endl;
+    return ok;
+}
+
+// Returns false if the bounded search's top 5 differs from scoring every
+// driver and sorting
+bool scored(size_t count, size_t checked, size_t queries) {
+    std::vector<Driver> drivers = randomDrivers(count, 25);
+    std::mt19937 rng(26);
+    std::uniform_real_distribution<float> rating(3.5f, 5.0f);
+    auto now = std::chrono::steady_clock::now();
+    std::vector<RatedDriver> rated(count);
+    for (size_t i = 0; i < count; ++i) {
+        rated[i] = {drivers[i], rating(rng), now - std::chrono::seconds(rng() % 1800)};
+    }
+
+    ScoredShard shard;
+    double buildMs = timeMs([&] { shard.build(rated); });
+    ProjectedShard nearest;
+    nearest.build(drivers);
+    std::unordered_map<int, const RatedDriver*> byId;
+    for (const RatedDriver& r : rated) byId[r.driver.id] = &r;
+
+    // What ranking looks like without bounds: take the nearest 50 and rescore them
+    auto rescored = [&](const Query& rider, size_t k) {
+        std::vector<std::pair<double, int>> ranked;
+        LocalProjection frame = nearest.projection();
+        LocalPoint at = frame.toLocal(rider.lat, rider.lng);
+        for (const Driver& d : nearest.findNearestNeighbors(rider.lat, rider.lng, 50)) {
+            const RatedDriver& r = *byId[d.id];
+            LocalPoint p = frame.toLocal(d.lat, d.lng);
+            double metres = std::hypot(double(at.x) - p.x, double(at.y) - p.y);
+            double idle = std::chrono::duration<double>(now - r.idleSince).count();
+            ranked.push_back({RatingAndIdleScore::score({metres, r.rating, idle}), d.id});
+        }
+        std::sort(ranked.begin(), ranked.end());
+        ranked.resize(std::min(k, ranked.size()));
+        return ranked;
+    };
+
+    std::vector<Query> riders(queries);
+    for (size_t i = 0; i < queries; ++i) riders[i] = {drivers[(i * 7919) % count].lat, drivers[(i * 7919) % count].lng};
+    std::vector<std::vector<ScoredDriver>> exact(queries);
+    std::vector<std::vector<std::pair<double, int>>> approximate(queries);
+    double scoredMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) exact[i] = shard.findBestScored(riders[i].lat, riders[i].lng, 5, now);
+    });
+    double rescoredMs = timeMs([&] {
+        for (size_t i = 0; i < queries; ++i) approximate[i] = rescored(riders[i], 5);
+    });
+    double plainMs = timeMs([&] {
+        for (const Query& rider : riders) nearest.findNearestNeighbors(rider.lat, rider.lng, 5);
+    });
+    size_t same = 0;
+    for (size_t i = 0; i < queries; ++i) {
+        bool match = exact[i].size() == approximate[i].size();
+        for (size_t j = 0; match && j < exact[i].size(); ++j) match = exact[i][j].driver.id == approximate[i][j].second;
+        same += match;
+    }
+
+    // Every driver scored in doubles and sorted. The shard keeps positions and
+    // idle times as floats, so scores agree to within millimetres and ties
+    // may come back in either order; compare scores rank by rank instead of ids.
+    LocalProjection frame = LocalProjection::fitting(drivers);
+    auto fullScore = [&](const LocalPoint& at, const RatedDriver& r) {
+        if (!r.driver.available) return std::numeric_limits<double>::infinity();
+        LocalPoint p = frame.toLocal(r.driver.lat, r.driver.lng);
+        double metres = std::hypot(double(at.x) - p.x, double(at.y) - p.y);
+        double idle = std::chrono::duration<double>(now - r.idleSince).count();
+        return RatingAndIdleScore::score({metres, r.rating, idle});
+    };
+    size_t sorted = 0;
+    std::vector<double> all(count);
+    for (size_t i = 0; i < checked; ++i) {
+        LocalPoint at = frame.toLocal(riders[i].lat, riders[i].lng);
+        for (size_t j = 0; j < count; ++j) all[j] = fullScore(at, rated[j]);
+        std::partial_sort(all.begin(), all.begin() + 5, all.end());
+        // Each pick scores what its rank should, and really has that score
+        bool match = exact[i].size() == 5;
+        for (size_t j = 0; match && j < 5; ++j) {
+            match = std::abs(exact[i][j].score - all[j]) < 0.05 &&
+                    std::abs(fullScore(at, *byId[exact[i][j].driver.id]) - all[j]) < 0.05;
+        }
+        sorted += match;
+    }
+    bool passed = sorted == checked;
+
+    std::cout << "scored: n=" << count << ", build " << buildMs << " ms; " << queries << " x best 5 by score "
+              << scoredMs << " ms (plain 5-NN " << plainMs << " ms); nearest-50 rescored " << rescoredMs
+              << " ms, " << same << "/" << queries << " matching the exact ranking; "
+              << sorted << "/" << checked << " match a full sort" << (passed ? "" : " FAILED") << std::endl;
+    return passed;
+}
+
+// Great-circle distance on the same sphere LocalProjection assumes
+double haversineMetres(double lat1, double lng1, double lat2, double lng2) {
+    constexpr double toRadians = std::numbers::pi / 180.0;
+    double sinLat = std::sin((lat2 - lat1) * toRadians / 2);
+    double sinLng = std::sin((lng2 - lng1) * toRadians / 2);
+    double h = sinLat * sinLat + std::cos(lat1 * toRadians) * std::cos(lat2 * toRadians) * sinLng * sinLng;
+    return 2 * LocalProjection::kEarthRadiusMetres * std::asin(std::sqrt(h));
+}
+
+// Drivers spread over a `halfWidthKm` square around a city centre
+std::vector<Driver> cityDrivers(double lat, double lng, double halfWidthKm, size_t count, uint32_t seed) {
+    double dLat = halfWidthKm * 1000 / LocalProjection::kMetresPerDegree;
+    double dLng = dLat / std::cos(lat * std::numbers::pi / 180.0);
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> latitude(lat - dLat, lat + dLat);
+    std::uniform_real_distribution<double> longitude(lng - dLng, lng + dLng);
+    std::vector<Driver> drivers;
+    drivers.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        drivers.push_back({static_cast<int>(i), latitude(rng), std::remainder(longitude(rng), 360.0), "driver", true});
+    }
+    return drivers;
+}
+
+// How often each index returns exactly the true 5 nearest by great-circle
+// distance, and what its queries cost
+void projected(size_t count, size_t checked, size_t queries) {
+    const std::tuple<const char*, double, double> cities[] = {
+        {"singapore", 1.35, 103.82},
+        {"new york", 40.71, -74.00},
+        {"oslo", 59.91, 10.75},
+        {"tromso", 69.65, 18.96},
+        {"taveuni", -16.85, 179.98},
+        {"near pole", 89.5, 0.0},
+    };
+    for (const auto& [city, lat, lng] : cities) {
+        std::vector<Driver> drivers = cityDrivers(lat, lng, 25.0, count, 21);
+        KDTree tree;
+        tree.build(drivers, NodeLayout::VanEmdeBoas);
+        ProjectedShard shard;
+        shard.build(drivers);
+        ProjectedShard sphere;
+        sphere.build(drivers, NodeLayout::VanEmdeBoas, ShardGeometry::Ecef);
+
+        std::mt19937 rng(23);
+        std::uniform_int_distribution<size_t> pick(0, count - 1);
+        std::normal_distribution<double> jitter(0.0, 0.005);
+        std::vector<Query> riders;
+        for (size_t i = 0; i < queries; ++i) {
+            const Driver& d = drivers[pick(rng)];
+            riders.push_back({std::min(d.lat + jitter(rng), 90.0), std::remainder(d.lng + jitter(rng), 360.0)});
+        }
+
+        size_t treeExact = 0;
+        size_t shardExact = 0;
+        size_t sphereExact = 0;
+        std::vector<std::pair<double, int>> truth(count);
+        for (size_t i = 0; i < checked; ++i) {
+            const Query& rider = riders[i];
+            for (size_t j = 0; j < count; ++j) {
+                truth[j] = {haversineMetres(rider.lat, rider.lng, drivers[j].lat, drivers[j].lng), drivers[j].id};
+            }
+            std::partial_sort(truth.begin(), truth.begin() + 5, truth.end());
+            auto matches = [&](const std::vector<Driver>& found) {
+                if (found.size() != 5) return false;
+                for (size_t r = 0; r < 5; ++r) {
+                    if (found[r].id != truth[r].second) return false;
+                }
+                return true;
+            };
+            treeExact += matches(tree.findNearestNeighbors(rider.lat, rider.lng, 5));
+            shardExact += matches(shard.findNearestNeighbors(rider.lat, rider.lng, 5));
+            sphereExact += matches(sphere.findNearestNeighbors(rider.lat, rider.lng, 5));
+        }
+
+        std::array<Neighbor, 5> out;
+        size_t found = 0;
+        double treeMs = timeMs([&] {
+            for (const Query& rider : riders) found += tree.findNearestNeighbors(rider.lat, rider.lng, std::span<Neighbor>(out));
+        });
+        double shardMs = timeMs([&] {
+            for (const Query& rider : riders) found += shard.findNearestNeighbors(rider.lat, rider.lng, std::span<Neighbor>(out));
+        });
+        double sphereMs = timeMs([&] {
+            for (const Query& rider : riders) found += sphere.findNearestNeighbors(rider.lat, rider.lng, std::span<Neighbor>(out));
+        });
+
+        std::cout << "projection " << city << ": n=" << count
+                  << " exact top-5 degrees " << treeExact << "/" << checked
+                  << ", metres " << shardExact << "/" << checked
+                  << ", ecef " << sphereExact << "/" << checked
+                  << "; " << queries << " x 5-NN degrees " << treeMs << " ms / metres " << shardMs << " ms"
+                  << " / ecef " << sphereMs << " ms"
+                  << " (" << found << " hits)" << std::endl;
+    }
+}
+
+// Square street grid with `side` nodes a side, 100 m apart and driven at
+// 12 m/s, cut down the middle by a river with a bridge every `bridgeEvery` rows
+RoadGraph riverCity(int side, int bridgeEvery, double lat, double lng) {
+    constexpr double spacing = 100.0;
+    constexpr float seconds = static_cast<float>(spacing / 12.0);
+    double dLat = spacing / LocalProjection::kMetresPerDegree;
+    double dLng = dLat / std::cos(lat * std::numbers::pi / 180.0);
+    std::vector<RoadNode> nodes;
+    std::vector<RoadEdge> edges;
+    auto at = [side](int row, int col) { return static_cast<int32_t>(row * side + col); };
+    for (int row = 0; row < side; ++row) {
+        for (int col = 0; col < side; ++col) {
+            nodes.push_back({lat + row * dLat, lng + col * dLng});
+            bool river = col + 1 == side / 2 && row % bridgeEvery != bridgeEvery / 2;
+            if (col + 1 < side && !river) {
+                edges.push_back({at(row, col), at(row, col + 1), seconds});
+                edges.push_back({at(row, col + 1), at(row, col), seconds});
+            }
+            if (row + 1 < side) {
+                edges.push_back({at(row, col), at(row + 1, col), seconds});
+                edges.push_back({at(row + 1, col), at(row, col), seconds});
+            }
+        }
+    }
+    RoadGraph graph;
+    graph.build(std::move(nodes), edges);
+    return graph;
+}
+
+// Straight-line vs travel-time ranking for riders near the river, cold and
+// with every pickup node already cached
+void reranked(size_t count, size_t hotSpots, size_t queries) {
+    constexpr int side = 200;
+    constexpr double lat = 40.70;
+    constexpr double lng = -74.00;
+    RoadGraph graph = riverCity(side, 50, lat, lng);
+
+    double spanLat = side * 100.0 / LocalProjection::kMetresPerDegree;
+    double spanLng = spanLat / std::cos(lat * std::numbers::pi / 180.0);
+    std::mt19937 rng(29);
+    std::uniform_real_distribution<double> latitude(lat, lat + spanLat);
+    std::uniform_real_distribution<double> longitude(lng, lng + spanLng);
+    std::uniform_real_distribution<double> nearRiver(lng + spanLng * 0.45, lng + spanLng * 0.55);
+    std::vector<Driver> drivers;
+    for (size_t i = 0; i < count; ++i) {
+        drivers.push_back({static_cast<int>(i), latitude(rng), longitude(rng), "driver", true});
+    }
+    std::vector<Query> spots;
+    for (size_t i = 0; i < hotSpots; ++i) spots.push_back({latitude(rng), nearRiver(rng)});
+
+    ProjectedShard shard;
+    shard.build(drivers);
+    RoadReranker reranker(graph);
+
+    size_t reordered = 0;
+    double straightEta = 0.0;
+    double roadEta = 0.0;
+    auto pass = [&](bool score) {
+        for (size_t i = 0; i < queries; ++i) {
+            const Query& rider = spots[i % spots.size()];
+            std::vector<RankedDriver> ranked = reranker.findNearestByTravelTime(shard, rider.lat, rider.lng, 32);
+            if (!score || ranked.empty()) continue;
+            int closest = shard.findNearestNeighbors(rider.lat, rider.lng, 1)[0].id;
+            for (const RankedDriver& entry : ranked) {
+                if (entry.driver.id == closest) straightEta += std::min(entry.etaSeconds, 900.0);
+            }
+            roadEta += std::min(ranked[0].etaSeconds, 900.0);
+            reordered += ranked[0].driver.id != closest;
+        }
+    };
+    double coldMs = timeMs([&] { pass(true); });
+    double warmMs = timeMs([&] { pass(false); });
+
+    RerankStats stats = reranker.stats();
+    std::cout << "rerank: n=" << count << ", " << queries << " riders at " << hotSpots << " spots"
+              << "; first pick changed " << reordered << " times"
+              << ", mean eta straight-line " << straightEta / queries << " s / road " << roadEta / queries << " s"
+              << "; cold " << coldMs << " ms, warm " << warmMs << " ms"
+              << " (" << stats.originHits << " hits / " << stats.originMisses << " misses)" << std::endl;
+
+    // Riders scattered ~50 m around the spots snap to many different nodes,
+    // so only the cell-pair cache can share work between them
+    std::normal_distribution<double> jitter(0.0, 50.0 / LocalProjection::kMetresPerDegree);
+    std::vector<Query> riders;
+    for (size_t i = 0; i < queries; ++i) {
+        const Query& spot = spots[i % spots.size()];
+        riders.push_back({spot.lat + jitter(rng), spot.lng + jitter(rng)});
+    }
+    RoadReranker exact(graph);
+    RoadReranker cached(graph);
+    EtaCache etas(graph.projection());
+    cached.setEtaCache(&etas);
+    std::vector<std::vector<RankedDriver>> exactRanks;
+    double exactMs = timeMs([&] {
+        for (const Query& rider : riders) {
+            exactRanks.push_back(exact.findNearestByTravelTime(shard, rider.lat, rider.lng, 32));
+        }
+    });
+    // Exact ETA of the cached pick over that of the exact pick
+    double regret = 0.0;
+    double cachedColdMs = timeMs([&] {
+        for (size_t i = 0; i < riders.size(); ++i) {
+            int pick = cached.findNearestByTravelTime(shard, riders[i].lat, riders[i].lng, 1)[0].driver.id;
+            for (const RankedDriver& entry : exactRanks[i]) {
+                if (entry.driver.id == pick) regret += std::min(entry.etaSeconds, 900.0) - std::min(exactRanks[i][0].etaSeconds, 900.0);
+            }
+        }
+    });
+    double cachedWarmMs = timeMs([&] {
+        for (const Query& rider : riders) cached.findNearestByTravelTime(shard, rider.lat, rider.lng, 1);
+    });
+
+    EtaCacheStats etaStats = etas.stats();
+    RerankStats cachedStats = cached.stats();
+    std::cout << "rerank eta cache: " << riders.size() << " scattered riders"
+              << " exact " << exactMs << " ms / cached cold " << cachedColdMs << " ms, warm " << cachedWarmMs << " ms"
+              << "; hit ratio " << etaStats.hitRatio()
+              << ", " << cachedStats.answeredFromCache << " queries fully cached"
+              << ", " << cachedStats.savedMs() << " ms of search saved"
+              << "; pick costs " << regret / riders.size() << " s more than exact on average" << std::endl;
+}
+
+// Run every benchmark, or only the one named by `only`; false if a check failed
+bool run(const char* only) {
+    bool ok = true;
+    auto selected = [only](const char* name) { return only == nullptr || std::strcmp(only, name) == 0; };
+    if (selected("traversal")) traversal("uniform", randomDrivers(1000000, 1), 200000);
+    if (selected("layout")) layouts(4000000, 500000);
+    if (selected("batch")) batched(4000000, 500000);
+    if (selected("pool")) pooled(2000000, 200000);
+    if (selected("replicas")) replicated(1000000, 200000);
+    if (selected("updates")) {
+        updates(1000000, 20000);
+        updates(1000000, 250000);
+        updates(1000000, 2000000);
+        ok &= batchMatchesSequential(200000, 20000);
+    }
+    if (selected("churn")) ok &= churn(1000000, 100000);
+    if (selected("versions")) {
+        versioned(1000000, 100, 1000, 100000);
+        ok &= historyMatches(20000, 60, 500, 300);
+    }
+    if (selected("doublebuffer")) ok &= doubleBuffered(1000000, 200000);
+    if (selected("lsm")) {
+        logStructured(1000000, 1000, 20000);
+        ok &= deltaMatchesTree(50000, 20000, 2000);
+    }
+    if (selected("resultcache")) ok &= resultCached(1000000, 20000, 20, 20000);
+    if (selected("geofence")) ok &= fenced(1000000, 200, 20000);
+    if (selected("airport")) ok &= airportQueues(1000000, 500000, 20000);
+    if (selected("heatmap")) ok &= heatmap(1000000, 100000, 10);
+    if (selected("density")) {
+        density(1000000, 100000, 10);
+        ok &= densityMatchesScan(20000, 20);
+    }
+    if (selected("tenants")) ok &= tenants(1000000, 8, 100000);
+    if (selected("scored")) ok &= scored(1000000, 100, 100000);
+    if (selected("projection")) projected(200000, 300, 200000);
+    if (selected("rerank")) reranked(50000, 500, 5000);
+    if (selected("degenerate")) degenerate();
+    if (selected("allocs")) {
+        ok &= allocations(1000000, 100000);
+        ok &= contextWrappers(200000, 20000);
+    }
+    return ok;
+}
+
+} // namespace bench
+
+// Main function for testing
+int main(int argc, char** argv) {
+    if (argc > 1 && std::strcmp(argv[1], "--bench") == 0) {
+        return bench::run(argc > 2 ? argv[2] : nullptr) ? 0 : 1;
+    }
+
+    KDTree tree;
+
     // Sample drivers
     std::vector<Driver> drivers = {
         {1, 40.7128, -74.0060, "John", true},
@@ -192,8 +6988,8 @@ int main() {
 
     std::cout << "Nearest drivers:" << std::endl;
     for (const auto& driver : nearest) {
-        std::cout << "Driver ID: " << driver.id << ", Name: " << driver.name << std::endl;
+        std::cout << "Driver ID: " << driver.id << ", Name: " << driver.name() << std::endl;
     }
 
     return 0;
-} 
\ No newline at end of file
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
+
+// CPUs grouped by NUMA node, read from sysfs. Machines without the sysfs
+// tree are treated as a single node holding every CPU.
+struct NumaTopology {
+    std::vector<std::vector<int>> nodeCpus;
+    std::vector<int> nodeByCpu;
+
+    static NumaTopology detect() {
+        NumaTopology topology;
+        for (int node = 0;; ++node) {
+            std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+            if (!in) break;
+            std::string list;
+            std::getline(in, list);
+            topology.nodeCpus.push_back(parseCpuList(list));
+        }
+        if (topology.nodeCpus.empty()) {
+            std::vector<int> all;
+            unsigned count = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned cpu = 0; cpu < count; ++cpu) all.push_back(static_cast<int>(cpu));
+            topology.nodeCpus.push_back(all);
+        }
+        for (size_t node = 0; node < topology.nodeCpus.size(); ++node) {
+            for (int cpu : topology.nodeCpus[node]) {
+                if (static_cast<size_t>(cpu) >= topology.nodeByCpu.size()) topology.nodeByCpu.resize(cpu + 1, 0);
+                topology.nodeByCpu[cpu] = static_cast<int>(node);
+            }
+        }
+        return topology;
+    }
+
+    size_t nodeCount() const { return nodeCpus.size(); }
+
+    int nodeOfCpu(int cpu) const {
+        return cpu >= 0 && static_cast<size_t>(cpu) < nodeByCpu.size() ? nodeByCpu[cpu] : 0;
+    }
+
+    // Node of the CPU the calling thread is running on right now
+    int currentNode() const {
+        return nodeOfCpu(sched_getcpu());
+    }
+
+private:
+    // Parse "0-3,8,10-11" style lists
+    static std::vector<int> parseCpuList(const std::string& list) {
+        std::vector<int> cpus;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = list.find(',', pos);
+            if (end == std::string::npos) end = list.size();
+            std::string item = list.substr(pos, end - pos);
+            size_t dash = item.find('-');
+            if (!item.empty()) {
+                int first = std::stoi(item.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(item.substr(dash + 1));
+                for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+            }
+            pos = end + 1;
+        }
+        return cpus;
+    }
+};
+
+// Pins the calling thread to the given CPUs; returns false if the kernel refused
+inline bool pinCurrentThread(const std::vector<int>& cpus) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+struct ThreadPoolConfig {
+    // Worker threads; 0 means one per hardware thread
+    size_t threads = 0;
+    // Pin worker i to a single CPU, spreading consecutive workers across NUMA nodes
+    bool pinWorkers = false;
+    // Default number of items handed to one task by parallelFor
+    size_t grainSize = 256;
+};
+
+// Query work always runs before maintenance work such as rebuilds or compaction
+enum class TaskPriority {
+    Query,
+    Maintenance
+};
+
+// Work-stealing pool for index operations. Every worker owns a deque of query
+// tasks, popping its own newest work and stealing the oldest from others when
+// idle; maintenance tasks sit in a shared queue that is only drained when no
+// query task can be found anywhere.
+class ThreadPool {
+public:
+    using Task = std::function<void()>;
+
+    explicit ThreadPool(const ThreadPoolConfig& cfg = {})
+        : config(cfg), topology(NumaTopology::detect()) {
+        size_t count = config.threads;
+        if (count == 0) count = std::max(1u, std::thread::hardware_concurrency());
+        config.grainSize = std::max<size_t>(1, config.grainSize);
+
+        for (size_t i = 0; i < count; ++i) {
+            queues.push_back(std::make_unique<WorkerQueue>());
+        }
+        std::vector<int> placement = spreadAcrossNodes();
+        for (size_t i = 0; i < count; ++i) {
+            int cpu = placement.empty() ? -1 : placement[i % placement.size()];
+            workers.emplace_back([this, i, cpu] { workerLoop(i, cpu); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+    size_t grainSize() const { return config.grainSize; }
+    const NumaTopology& numa() const { return topology; }
+
+    void submit(Task task, TaskPriority priority = TaskPriority::Query) {
+        if (priority == TaskPriority::Maintenance) {
+            std::lock_guard<std::mutex> lock(maintenanceMutex);
+            maintenance.push_back(std::move(task));
+        } else {
+            WorkerQueue& queue = targetQueue();
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        pending.fetch_add(1, std::memory_order_release);
+        notifyOne();
+    }
+
+    // Enqueue many query tasks with one lock and one wake-up per worker
+    void submitBatch(std::vector<Task> tasks) {
+        if (tasks.empty()) return;
+        size_t count = tasks.size();
+        size_t perQueue = (count + queues.size() - 1) / queues.size();
+        for (size_t q = 0, next = 0; q < queues.size() && next < count; ++q) {
+            std::lock_guard<std::mutex> lock(queues[q]->mutex);
+            for (size_t i = 0; i < perQueue && next < count; ++i, ++next) {
+                queues[q]->tasks.push_back(std::move(tasks[next]));
+            }
+        }
+        pending.fetch_add(count, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_all();
+    }
+
+    // Call fn(begin, end) over [0, count) in chunks of `grain` items and wait
+    // for all of them. The calling thread runs tasks too, so nested use from
+    // inside a worker cannot deadlock.
+    template <typename Fn>
+    void parallelFor(size_t count, size_t grain, Fn&& fn) {
+        if (count == 0) return;
+        grain = std::max<size_t>(1, grain);
+        size_t chunks = (count + grain - 1) / grain;
+        if (chunks == 1) {
+            fn(size_t{0}, count);
+            return;
+        }
+
+        std::atomic<size_t> remaining{chunks};
+        std::vector<Task> tasks;
+        tasks.reserve(chunks);
+        for (size_t chunk = 0; chunk < chunks; ++chunk) {
+            size_t begin = chunk * grain;
+            size_t end = std::min(count, begin + grain);
+            tasks.push_back([&fn, &remaining, begin, end] {
+                fn(begin, end);
+                remaining.fetch_sub(1, std::memory_order_acq_rel);
+            });
+        }
+        submitBatch(std::move(tasks));
+
+        while (remaining.load(std::memory_order_acquire) > 0) {
+            if (!runOneTask(TaskPriority::Query)) std::this_thread::yield();
+        }
+    }
+
+    template <typename Fn>
+    void parallelFor(size_t count, Fn&& fn) {
+        parallelFor(count, config.grainSize, std::forward<Fn>(fn));
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    ThreadPoolConfig config;
+    NumaTopology topology;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex maintenanceMutex;
+    std::deque<Task> maintenance;
+
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> nextQueue{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    static constexpr size_t kNoWorker = static_cast<size_t>(-1);
+
+    // The pool the calling thread works for, if any, and its queue there.
+    // Shared by every pool, so the owner is checked before the index is used.
+    struct WorkerSlot {
+        const ThreadPool* pool = nullptr;
+        size_t index = kNoWorker;
+    };
+
+    static WorkerSlot& workerSlot() {
+        thread_local WorkerSlot slot;
+        return slot;
+    }
+
+    // This pool's queue owned by the calling thread, or kNoWorker for
+    // outside threads, including workers of other pools
+    size_t currentWorker() const {
+        const WorkerSlot& slot = workerSlot();
+        return slot.pool == this ? slot.index : kNoWorker;
+    }
+
+    // One CPU per slot, taking node 0's first CPU, then node 1's first, and so on
+    std::vector<int> spreadAcrossNodes() const {
+        std::vector<int> order;
+        if (!config.pinWorkers) return order;
+        for (size_t round = 0;; ++round) {
+            bool any = false;
+            for (const auto& cpus : topology.nodeCpus) {
+                if (round < cpus.size()) {
+                    order.push_back(cpus[round]);
+                    any = true;
+                }
+            }
+            if (!any) break;
+        }
+        return order;
+    }
+
+    // Workers keep their own spawn local; outside threads spread round-robin
+    WorkerQueue& targetQueue() {
+        size_t self = currentWorker();
+        if (self != kNoWorker) return *queues[self];
+        return *queues[nextQueue.fetch_add(1, std::memory_order_relaxed) % queues.size()];
+    }
+
+    void notifyOne() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_one();
+    }
+
+    bool popLocal(size_t self, Task& task) {
+        WorkerQueue& queue = *queues[self];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t self, Task& task) {
+        size_t count = queues.size();
+        size_t start = self == kNoWorker ? 0 : self + 1;
+        for (size_t offset = 0; offset < count; ++offset) {
+            WorkerQueue& victim = *queues[(start + offset) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (victim.tasks.empty()) continue;
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    bool popMaintenance(Task& task) {
+        std::lock_guard<std::mutex> lock(maintenanceMutex);
+        if (maintenance.empty()) return false;
+        task = std::move(maintenance.front());
+        maintenance.pop_front();
+        return true;
+    }
+
+    // Run a single task if one is available at or above `lowest` priority
+    bool runOneTask(TaskPriority lowest) {
+        size_t self = currentWorker();
+        Task task;
+        bool found = (self != kNoWorker && popLocal(self, task)) || steal(self, task);
+        if (!found && lowest == TaskPriority::Maintenance) found = popMaintenance(task);
+        if (!found) return false;
+
+        pending.fetch_sub(1, std::memory_order_acq_rel);
+        task();
+        return true;
+    }
+
+    void workerLoop(size_t index, int cpu) {
+        workerSlot() = {this, index};
+        if (cpu >= 0) pinCurrentThread({cpu});
+
+        while (true) {
+            if (runOneTask(TaskPriority::Maintenance)) continue;
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || pending.load(std::memory_order_acquire) > 0; });
+            if (stopping && pending.load(std::memory_order_acquire) == 0) return;
+        }
+    }
+};